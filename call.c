@@ -2,45 +2,118 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 #include <arpa/inet.h>
 #include "car_shared_mem.h"
+#include "protocol.h"
 
-#define PORT 3000
 #define BUFFER_SIZE 1024
 
+// Print a controller reply to a CALL
+void print_response(const char *response) {
+    if (strncmp(response, "CAR ", 4) == 0) {
+        printf("Car %s is arriving.\n", response + 4);
+    } else if (strcmp(response, "UNAVAILABLE") == 0) {
+        printf("Sorry, no car is available to take this request.\n");
+    } else {
+        printf("Invalid response from controller.\n");
+    }
+}
+
+// Validate a pair of floors, printing why they are rejected
+int check_floors(const char *source_floor, const char *destination_floor) {
+    int source, destination;
+    if (parse_floor(source_floor, strlen(source_floor), &source) == -1 ||
+        parse_floor(destination_floor, strlen(destination_floor), &destination) == -1) {
+        printf("Invalid floor(s) specified.\n");
+        return -1;
+    }
+    if (source == destination) {
+        fprintf(stderr, "Source and destination floors cannot be the same\n");
+        return -1;
+    }
+    return 0;
+}
+
+// Session mode: print replies as they arrive, in whatever order
+void *session_replies(void *arg) {
+    int sock = *(int *)arg;
+    msg_buf buf;
+    msg_buf_init(&buf);
+    char *frame;
+    size_t len;
+    while ((frame = next_msg(sock, &buf, &len)) != NULL) {
+        uint32_t id;
+        const char *response;
+        size_t response_len;
+        if (parse_request_id(frame, len, &id, &response, &response_len) == -1) {
+            printf("Invalid response from controller.\n");
+            continue;
+        }
+        printf("%u: ", id);
+        print_response(response);
+        fflush(stdout);
+    }
+    return NULL;
+}
+
+// Read "{source floor} {destination floor}" lines from stdin and send them
+// all down one connection without waiting for replies. Request ids are
+// line numbers.
+int run_session(int sock) {
+    send_message(sock, "SESSION");
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, session_replies, &sock);
+
+    char line[BUFFER_SIZE];
+    uint32_t id = 0;
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        id++;
+        char source_floor[8], destination_floor[8];
+        if (sscanf(line, "%7s %7s", source_floor, destination_floor) != 2) {
+            continue;
+        }
+        if (check_floors(source_floor, destination_floor) == -1) {
+            continue;
+        }
+        char request[BUFFER_SIZE];
+        snprintf(request, BUFFER_SIZE, "%u CALL %s %s", id, source_floor, destination_floor);
+        if (send_message(sock, request) == -1) {
+            break;
+        }
+    }
+
+    // The controller closes the session once every reply is out
+    shutdown(sock, SHUT_WR);
+    pthread_join(reader, NULL);
+    close(sock);
+    return 0;
+}
+
 int main(int argc, char **argv) {
-    if (argc != 3) {
+    int session = argc == 2 && strcmp(argv[1], "--session") == 0;
+    if (argc != 3 && !session) {
         fprintf(stderr, "Usage: %s {source floor} {destination floor}\n", argv[0]);
+        fprintf(stderr, "       %s --session < {calls}\n", argv[0]);
         exit(EXIT_FAILURE);
     }
 
     char *source_floor = argv[1];
     char *destination_floor = argv[2];
-
-    // Validate floors
-    if (strcmp(source_floor, destination_floor) == 0) {
-        fprintf(stderr, "Source and destination floors cannot be the same\n");
+    if (!session && check_floors(source_floor, destination_floor) == -1) {
         exit(EXIT_FAILURE);
     }
 
-    // Create socket
-    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    // Connect to controller, over $ELEVATOR_SOCKET if it is set
+    int sock = connect_controller(NULL);
     if (sock == -1) {
-        perror("socket");
-        exit(EXIT_FAILURE);
-    }
-
-    // Connect to controller
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(PORT);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        close(sock);
         fprintf(stderr, "Unable to connect to elevator system.\n");
         exit(EXIT_FAILURE);
     }
+    if (session) {
+        return run_session(sock);
+    }
 
     // Send call request
     char request[BUFFER_SIZE];
@@ -54,18 +127,9 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Error receiving response from elevator system.\n");
         exit(1);
     }
-    
-    // Handle response
-    if (strncmp(response, "CAR", 3) == 0) {
-        char car_name[50];
-        sscanf(response, "CAR %s", car_name);
-        printf("Car %s is arriving.\n", car_name);
-    } else if (strcmp(response, "UNAVAILABLE") == 0) {
-        printf("Sorry, no car is available to take this request.\n");
-    } else {
-        printf("Invalid response from controller.\n");
-    }
+    print_response(response);
+    free(response);
 
     close(sock);
     return 0;
-}
\ No newline at end of file
+}
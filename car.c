@@ -11,6 +11,7 @@
 #include <signal.h>
 #include <errno.h>
 #include "car_shared_mem.h"
+#include "protocol.h"
 
 #define BUFFER_SIZE 1024
 #define NO_MOVEMENT "NONE"
@@ -24,6 +25,14 @@ int delay;
 int delay_ms;
 int shm_fd;
 char shm_name[256];
+int want_binary;    // --binary: ask the controller for binary records
+int use_binary;     // Set once the controller has acknowledged them
+const char *unix_path; // --unix: controller socket path, else $ELEVATOR_SOCKET or TCP
+int want_shm;       // --shm: ask for STATUS/FLOOR over a shared-memory channel
+int use_shm;        // Set once the controller has mapped it
+shm_channel *channel;
+char channel_name[sizeof(SHM_CHANNEL_PREFIX) + sizeof(car_name)];
+int leaving;        // Set while the car hangs up on the controller, see main()
 
 void initialize_shared_memory() {
     snprintf(shm_name, sizeof(shm_name), "/car%s", car_name);
@@ -73,6 +82,10 @@ void signal_handler(int signum) {
         munmap(shared_mem, sizeof(car_shared_mem));
         close(shm_fd);
         shm_unlink(shm_name);
+        if (channel != NULL) {
+            munmap(channel, sizeof(shm_channel));
+            shm_unlink(channel_name);
+        }
         close(server_socket);
         printf("Shared memory unlinked and closed\n");
         exit(EXIT_SUCCESS);
@@ -115,194 +128,363 @@ void format_floor(int floor, char *floor_str, size_t size) {
     }
 }
 
-int connect_to_controller() {
-    struct sockaddr_in server_addr;
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
-        perror("socket()");
-        return 0;
-    }
+// Create the channel offered to the controller with SHM_OPTION
+void initialize_channel() {
+    snprintf(channel_name, sizeof(channel_name), SHM_CHANNEL_PREFIX "%s", car_name);
 
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(3000);
-    const char *server_ip = "127.0.0.1";
-    if (inet_pton(AF_INET, server_ip, &server_addr.sin_addr) != 1) {
-        fprintf(stderr, "inet_pton(%s)\n", server_ip);
-        return 0;
+    int fd = shm_open(channel_name, O_CREAT | O_RDWR, 0666);
+    if (fd == -1) {
+        perror("shm_open");
+        exit(EXIT_FAILURE);
+    }
+    // Start from empty rings even if a previous run left the object behind
+    if (ftruncate(fd, 0) == -1 || ftruncate(fd, sizeof(shm_channel)) == -1) {
+        perror("ftruncate");
+        exit(EXIT_FAILURE);
+    }
+    channel = mmap(0, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (channel == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
     }
+}
 
-    if (connect(server_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        perror("connect()");
+int connect_to_controller() {
+    server_socket = connect_controller(unix_path);
+    if (server_socket == -1) {
+        static int reported;
+        if (!reported) {
+            perror("connect()");
+            reported = 1;
+        }
         return 0;
     }
 
     char message[BUFFER_SIZE];
-    snprintf(message, BUFFER_SIZE, "CAR %s %s %s", car_name, lowest_floor, highest_floor);
+    snprintf(message, BUFFER_SIZE, "CAR %s %s %s%s%s", car_name, lowest_floor, highest_floor,
+             want_binary ? " " BINARY_OPTION : "", want_shm ? " " SHM_OPTION : "");
     send_message(server_socket, message);
 
     return 1;
 }
 
-// Modify receive_commands():
+void set_destination(int floor_num) {
+    char floor[4];
+    format_floor(floor_num, floor, sizeof(floor));
+    pthread_mutex_lock(&shared_mem->mutex);
+    // Sending a stopped car to the floor it is on opens its doors
+    if (strcmp(shared_mem->current_floor, floor) == 0 && strcmp(shared_mem->status, "Between") != 0) {
+        shared_mem->open_button = 1;
+    }
+    strncpy(shared_mem->destination_floor, floor, sizeof(shared_mem->destination_floor));
+    pthread_cond_broadcast(&shared_mem->cond);
+    pthread_mutex_unlock(&shared_mem->mutex);
+}
+
+// Handle a binary FLOOR record from the socket or the channel
+void handle_floor_record(const char *frame, size_t len) {
+    wire_floor record;
+    if (len != sizeof(record) || (uint8_t)frame[0] != WIRE_FLOOR) {
+        fprintf(stderr, "Invalid binary record from controller\n");
+        return;
+    }
+    memcpy(&record, frame, sizeof(record));
+    int floor_num = wire_floor_decode(record.floor);
+    char floor[4];
+    format_floor(floor_num, floor, sizeof(floor));
+    printf("RECV: FLOOR %s\n", floor);
+    set_destination(floor_num);
+}
+
+void *channel_commands(void *arg) {
+    char record[RING_SLOT_SIZE];
+    int len;
+    while ((len = ring_pop(&channel->to_car, record)) != -1) {
+        handle_floor_record(record, len);
+    }
+    return NULL;
+}
+
 void *receive_commands(void *arg) {
+    msg_buf buf;
+    msg_buf_init(&buf);
     while (1) {
-        char *buffer = receive_msg(server_socket);
-        printf("RECV: %s\n", buffer);
+        size_t len;
+        char *buffer = next_msg(server_socket, &buf, &len);
+        if (buffer == NULL) {
+            if (__atomic_load_n(&leaving, __ATOMIC_ACQUIRE)) {
+                return NULL;
+            }
+            fprintf(stderr, "Connection to controller lost\n");
+            exit(EXIT_FAILURE);
+        }
 
-        if (strncmp(buffer, "FLOOR", 5) == 0) {
-            char floor[4];
-            sscanf(buffer, "FLOOR %s", floor);
-            pthread_mutex_lock(&shared_mem->mutex);
-            strncpy(shared_mem->destination_floor, floor, sizeof(shared_mem->destination_floor));
-            pthread_cond_broadcast(&shared_mem->cond);
-            pthread_mutex_unlock(&shared_mem->mutex);
+        if (is_binary_frame(buffer, len)) {
+            handle_floor_record(buffer, len);
+            continue;
         }
+        printf("RECV: %s\n", buffer);
 
-        free(buffer);
+        if (want_binary && strcmp(buffer, BINARY_OPTION) == 0) {
+            __atomic_store_n(&use_binary, 1, __ATOMIC_RELEASE);
+        } else if (want_shm && strcmp(buffer, SHM_OPTION) == 0) {
+            // The channel outlives the connection, read it from one thread
+            static int reading_channel;
+            if (!reading_channel) {
+                pthread_t channel_thread;
+                pthread_create(&channel_thread, NULL, channel_commands, NULL);
+                pthread_detach(channel_thread);
+                reading_channel = 1;
+            }
+            __atomic_store_n(&use_shm, 1, __ATOMIC_RELEASE);
+        } else if (message_type(buffer, len) == MSG_FLOOR) {
+            int floor_num;
+            if (parse_floor_cmd(buffer, len, &floor_num) == -1) {
+                fprintf(stderr, "Invalid FLOOR command from controller\n");
+                continue;
+            }
+            set_destination(floor_num);
+        }
     }
     return NULL;
 }
 
 void send_status_update() {
+    int shm = __atomic_load_n(&use_shm, __ATOMIC_ACQUIRE);
+    if (shm || __atomic_load_n(&use_binary, __ATOMIC_ACQUIRE)) {
+        int status = status_from_name(shared_mem->status);
+        wire_status record = {
+            WIRE_STATUS,
+            status == -1 ? CLOSED : status,
+            wire_floor_encode(convert_floor(shared_mem->current_floor)),
+            wire_floor_encode(convert_floor(shared_mem->destination_floor))
+        };
+        if (!shm) {
+            send_frame(server_socket, &record, sizeof(record));
+        } else if (ring_push(&channel->to_controller, &record, sizeof(record)) == -1) {
+            fprintf(stderr, "Controller is not reading the shared memory channel\n");
+        }
+        return;
+    }
+
     char message[BUFFER_SIZE];
     snprintf(message, BUFFER_SIZE, "STATUS %s %s %s", shared_mem->status, shared_mem->current_floor, shared_mem->destination_floor);
     send_message(server_socket, message);
 }
 
-void *status_update_thread(void *arg) {
+// Report the car's state as soon as it connects and then whenever it
+// changes, until it goes into individual service or emergency mode. Returns
+// the message that tells the controller which. The mutex is only released
+// while waiting, so no change can be made and broadcast unseen between two
+// waits.
+const char *report_status() {
+    char sent[sizeof(shared_mem->status) + sizeof(shared_mem->current_floor) +
+              sizeof(shared_mem->destination_floor)] = "";
+    pthread_mutex_lock(&shared_mem->mutex);
     while (1) {
-        pthread_mutex_lock(&shared_mem->mutex);
+        if (shared_mem->individual_service_mode) {
+            pthread_mutex_unlock(&shared_mem->mutex);
+            return "INDIVIDUAL SERVICE";
+        }
+        if (shared_mem->emergency_mode) {
+            pthread_mutex_unlock(&shared_mem->mutex);
+            return "EMERGENCY";
+        }
+        char state[sizeof(sent)];
+        snprintf(state, sizeof(state), "%s %s %s", shared_mem->status,
+                 shared_mem->current_floor, shared_mem->destination_floor);
+        if (strcmp(state, sent) != 0) {
+            send_status_update();
+            strcpy(sent, state);
+        }
         pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
-        send_status_update();
-        pthread_mutex_unlock(&shared_mem->mutex);
     }
-    return NULL;
 }
 
-void *button_handler(void *arg) {
-    while (1) {
-        pthread_mutex_lock(&shared_mem->mutex);
+// Wait until the car is in neither individual service nor emergency mode
+void wait_for_service() {
+    pthread_mutex_lock(&shared_mem->mutex);
+    while (shared_mem->individual_service_mode || shared_mem->emergency_mode) {
+        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
+    }
+    pthread_mutex_unlock(&shared_mem->mutex);
+}
 
-        if (pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex) != 0) {
-            perror("pthread_cond_wait");
-            exit(EXIT_FAILURE);
-        } else {
-            if (shared_mem->open_button) {
-                if (strcmp(shared_mem->status, "Open") == 0) {
-                    usleep(delay_ms);
-                    strcpy(shared_mem->status, "Closing");
-                    usleep(delay_ms);
-                } else if (strcmp(shared_mem->status, "Closing") == 0 || strcmp(shared_mem->status, "Closed") == 0) {
-                    strcpy(shared_mem->status, "Opening");
-                    usleep(delay_ms);
-                }
-                shared_mem->open_button = 0;
-                // printf("Opening doors for car %s\n", car_name);
-                pthread_cond_broadcast(&shared_mem->cond);
-            }
+// Change status and let the status thread, and anyone else watching the
+// shared memory, see it. Caller must hold shared_mem->mutex.
+void set_status(const char *status) {
+    strcpy(shared_mem->status, status);
+    pthread_cond_broadcast(&shared_mem->cond);
+}
+
+// Wait until deadline with the shared memory unlocked, waking early if the
+// shared memory changes. Returns 0 once the deadline has passed.
+int wait_until(const struct timespec *deadline) {
+    return pthread_cond_timedwait(&shared_mem->cond, &shared_mem->mutex, deadline) != ETIMEDOUT;
+}
+
+void deadline_after_delay(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += (long)(delay_ms % 1000000) * 1000;
+    deadline->tv_sec += delay_ms / 1000000 + deadline->tv_nsec / 1000000000;
+    deadline->tv_nsec %= 1000000000;
+}
+
+// Spend one delay in the current status, whatever happens meanwhile
+void wait_delay() {
+    struct timespec deadline;
+    deadline_after_delay(&deadline);
+    while (wait_until(&deadline)) {
+    }
+}
 
+// Open the doors, hold them open and close them again. The open button
+// holds the doors open for another delay, or reopens them while they are
+// closing, and the close button closes them early. In individual service
+// mode the doors stay open until the close button is pressed.
+void door_cycle() {
+    struct timespec deadline;
+    shared_mem->open_button = 0;
+    set_status("Opening");
+    wait_delay();
+
+    for (;;) {
+        set_status("Open");
+        shared_mem->close_button = 0;
+        deadline_after_delay(&deadline);
+        for (;;) {
+            int woken = 1;
+            if (shared_mem->individual_service_mode) {
+                pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
+            } else {
+                woken = wait_until(&deadline);
+            }
             if (shared_mem->close_button) {
-                if (strcmp(shared_mem->status, "Open") == 0) {
-                    strcpy(shared_mem->status, "Closing");
-                    usleep(delay_ms);
-                }
                 shared_mem->close_button = 0;
-                // printf("Closing doors for car %s\n", car_name);
-                pthread_cond_broadcast(&shared_mem->cond);
+                break;
+            }
+            if (shared_mem->open_button) {
+                shared_mem->open_button = 0;
+                deadline_after_delay(&deadline);
+            } else if (!woken) {
+                break;
             }
         }
 
-        pthread_mutex_unlock(&shared_mem->mutex);
+        set_status("Closing");
+        deadline_after_delay(&deadline);
+        int reopen = 0;
+        while (wait_until(&deadline)) {
+            if (shared_mem->open_button || shared_mem->door_obstruction) {
+                reopen = 1;
+                break;
+            }
+        }
+        if (!reopen) {
+            break;
+        }
+        shared_mem->open_button = 0;
+        set_status("Opening");
+        wait_delay();
     }
-    return NULL;
+    set_status("Closed");
 }
 
-void *move_car(void *arg) {
-    int operation_complete = 1;
-    while (1) {
-        // printf("Current floor: %s\n", shared_mem->current_floor);
-        // printf("Destination floor: %s\n", shared_mem->destination_floor);
-        // printf("Status: %s\n", shared_mem->status);
-        pthread_mutex_lock(&shared_mem->mutex);
+// The next floor from current towards destination. There is no floor 0,
+// B1 is directly below 1.
+int floor_towards(int current, int destination) {
+    int next = current < destination ? current + 1 : current - 1;
+    if (next == 0) {
+        next = current < destination ? 1 : -1;
+    }
+    return next;
+}
 
+// Travel to the destination one floor per delay, reporting each floor
+// passed, then open the doors there. The destination can change on the way.
+// In individual service mode the car only moves one floor and the doors
+// stay shut.
+void travel() {
+    set_status("Between");
+    for (;;) {
+        wait_delay();
+        int current = convert_floor(shared_mem->current_floor);
+        int destination = convert_floor(shared_mem->destination_floor);
+        if (current != destination) {
+            format_floor(floor_towards(current, destination), shared_mem->current_floor,
+                         sizeof(shared_mem->current_floor));
+        }
+        if (shared_mem->individual_service_mode) {
+            strncpy(shared_mem->destination_floor, shared_mem->current_floor,
+                    sizeof(shared_mem->destination_floor));
+            shared_mem->open_button = 0;
+            set_status("Closed");
+            return;
+        }
         if (strcmp(shared_mem->current_floor, shared_mem->destination_floor) == 0) {
-            if (pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex)) {
-                perror("pthread_cond_wait");
-                exit(EXIT_FAILURE);
-            } else if (operation_complete) {
-                if (strcmp(shared_mem->status, "Closed") == 0) {
-                    strcpy(shared_mem->status, "Opening");
-                    pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-                    // printf("Opening doors for car %s\n", car_name);
-                    usleep(delay_ms);
-                    pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-                }
-                if (strcmp(shared_mem->status, "Opening") == 0) {
-                    strcpy(shared_mem->status, "Open");
-                    pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-                    // printf("Doors for car %s are open\n", car_name);
-                    usleep(delay_ms);
-                    pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-                }
-                if (strcmp(shared_mem->status, "Open") == 0) {
-                    strcpy(shared_mem->status, "Closing");
-                    pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-                    // printf("Closing doors for car %s\n", car_name);
-                    usleep(delay_ms);
-                    pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-                }
-                if (strcmp(shared_mem->status, "Closing") == 0) {
-                    strcpy(shared_mem->status, "Closed");
-                    pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-                    usleep(delay_ms);
-                    pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-                    operation_complete = 1;
-                }
-            }
+            door_cycle();
+            return;
         }
+        pthread_cond_broadcast(&shared_mem->cond);
+    }
+}
 
-        if (shared_mem->emergency_mode == 1 || shared_mem->individual_service_mode == 1) {
-            pthread_mutex_unlock(&shared_mem->mutex);
-            continue;
+// Run the car: move it to its destination, whether that was set by the
+// controller or directly in shared memory, and work the doors. Every change
+// is broadcast on the shared memory so that the status thread reports it.
+void *run_car(void *arg) {
+    int lowest = convert_floor(lowest_floor);
+    int highest = convert_floor(highest_floor);
+    pthread_mutex_lock(&shared_mem->mutex);
+    for (;;) {
+        int closed = strcmp(shared_mem->status, "Closed") == 0;
+        int destination = convert_floor(shared_mem->destination_floor);
+
+        if (shared_mem->open_button) {
+            if (closed) {
+                door_cycle();
+                continue;
+            }
+            shared_mem->open_button = 0;
         }
-
-        int current_floor_int = convert_floor(shared_mem->current_floor);
-        int destination_floor_int = convert_floor(shared_mem->destination_floor);
-        int highest_floor_int = convert_floor(highest_floor);
-        int lowest_floor_int = convert_floor(lowest_floor);
-
-        if (current_floor_int < destination_floor_int && current_floor_int < highest_floor_int) {
-            strcpy(shared_mem->status, "Between");
-            usleep(delay_ms);
-            strcpy(shared_mem->status, "Closed");
-            int new_floor = current_floor_int + 1;
-            format_floor(new_floor, shared_mem->current_floor, sizeof(shared_mem->current_floor));
-            pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-            pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-            operation_complete = 1;
-        } else if (current_floor_int > destination_floor_int && current_floor_int > lowest_floor_int) {
-            strcpy(shared_mem->status, "Between");
-            usleep(delay_ms);
-            strcpy(shared_mem->status, "Closed");
-            int new_floor = current_floor_int - 1;
-            format_floor(new_floor, shared_mem->current_floor, sizeof(shared_mem->current_floor));
-            pthread_mutex_unlock(&shared_mem->mutex); // Unlock before sleeping
-            pthread_mutex_lock(&shared_mem->mutex); // Lock again before accessing shared memory
-            operation_complete = 1;
+        shared_mem->close_button = 0;
+
+        if (closed && !shared_mem->emergency_mode &&
+            strcmp(shared_mem->current_floor, shared_mem->destination_floor) != 0) {
+            if (destination < lowest || destination > highest) {
+                // Out of range, stay where we are
+                strncpy(shared_mem->destination_floor, shared_mem->current_floor,
+                        sizeof(shared_mem->destination_floor));
+                pthread_cond_broadcast(&shared_mem->cond);
+                continue;
+            }
+            travel();
+            continue;
         }
 
-        pthread_cond_broadcast(&shared_mem->cond);
-        pthread_mutex_unlock(&shared_mem->mutex);
+        pthread_cond_wait(&shared_mem->cond, &shared_mem->mutex);
     }
     return NULL;
 }
 
 int main(int argc, char **argv) {
-    if (argc != 5) {
-        fprintf(stderr, "Usage: %s {name} {lowest floor} {highest floor} {delay}\n", argv[0]);
+    if (argc < 5) {
+        fprintf(stderr, "Usage: %s {name} {lowest floor} {highest floor} {delay} [--binary] [--shm] [--unix {path}]\n", argv[0]);
         exit(EXIT_FAILURE);
     }
+    for (int i = 5; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            want_binary = 1;
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            want_shm = 1;
+        } else if (strcmp(argv[i], "--unix") == 0 && i + 1 < argc) {
+            unix_path = argv[++i];
+        } else {
+            fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
 
     strncpy(car_name, argv[1], sizeof(car_name) - 1);
     strncpy(lowest_floor, argv[2], sizeof(lowest_floor) - 1);
@@ -311,24 +493,35 @@ int main(int argc, char **argv) {
     delay_ms = delay * 1000;
 
     initialize_shared_memory();
+    if (want_shm) {
+        initialize_channel();
+    }
 
     // Set up signal handler for clean termination
     signal(SIGINT, signal_handler);
 
-    pthread_t command_thread, status_thread, move_thread, button_thread;
+    pthread_t command_thread, car_thread;
 
-    if(connect_to_controller()){
+    pthread_create(&car_thread, NULL, run_car, NULL);
+    // The car is only connected to the controller while it is in service.
+    // In individual service or emergency mode it tells the controller, which
+    // hands its calls to other cars, and hangs up until the mode is cleared.
+    for (;;) {
+        wait_for_service();
+        // The car works on its own until the controller is up, try again every delay
+        while (!connect_to_controller()) {
+            usleep(delay_ms);
+        }
         pthread_create(&command_thread, NULL, receive_commands, NULL);
-        pthread_create(&status_thread, NULL, status_update_thread, NULL);
-    } else {
-        pthread_create(&move_thread, NULL, move_car, NULL);
-        pthread_create(&button_thread, NULL, button_handler, NULL);
-    }
 
-    pthread_join(command_thread, NULL);
-    pthread_join(status_thread, NULL);
-    pthread_join(move_thread, NULL);
-    pthread_join(button_thread, NULL);
-
-    return 0;
+        send_message(server_socket, report_status());
+        __atomic_store_n(&leaving, 1, __ATOMIC_RELEASE);
+        shutdown(server_socket, SHUT_RDWR);
+        pthread_join(command_thread, NULL);
+        close(server_socket);
+        __atomic_store_n(&leaving, 0, __ATOMIC_RELEASE);
+        // Records are negotiated again on the next connection
+        __atomic_store_n(&use_binary, 0, __ATOMIC_RELEASE);
+        __atomic_store_n(&use_shm, 0, __ATOMIC_RELEASE);
+    }
 }
\ No newline at end of file
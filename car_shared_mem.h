@@ -3,9 +3,20 @@
 
 #include <pthread.h>
 #include <stdint.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
+#include <arpa/inet.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "queue.h"
 
-#define MAX_QUEUE 10
 #define MAX_FLOOR_LEN 4
 
 #define SHM_NAME_PREFIX "/car"
@@ -45,66 +56,216 @@ enum operations {
 
 #define MAX_FLOORS 10 // Define as per the building's max floors
 
-typedef enum { UP, DOWN, NONE } Direction;
-
+// A passenger's trip, see Car.waiting
 typedef struct {
-    char floor[4];
-    Direction dir;
-} QueueItem;
+    int source_floor;
+    int destination_floor;
+} Trip;
 
-typedef struct {
-    QueueItem *items;
-    int size;
-    int capacity;
-} Queue;
+struct conn; // Reactor connection, see reactor.h
+struct channel; // Shared-memory channel, see channel.h
 
 typedef struct Car {
     char name[256];
-    char current_floor[4];
-    char current_destination[4];
-    char lowest_floor[4];
-    char highest_floor[4];
-    char status[8];
+    int16_t current_floor;           // Basements are negative, see floor_name() in protocol.h
+    int16_t current_destination;
+    int16_t floor_sent;              // Floor of the last FLOOR sent, see send_next_stop()
+    int16_t lowest_floor;
+    int16_t highest_floor;
+    uint8_t status;                  // enum car_status
+    uint8_t floor_acked;             // 1 once a STATUS the car sent after that FLOOR has come in
     int socket;
+    struct conn *conn;               // Set when the car is served by the epoll reactor
+    uint8_t binary;                  // 1 if STATUS/FLOOR use binary records, see protocol.h
+    struct channel *channel;         // Set when STATUS/FLOOR go through shared memory
+    int shard;                       // Owning reactor thread with --io shards, else -1
     pthread_cond_t cond;
     pthread_mutex_t mutex;
-    Direction direction;
+    Direction direction;             // Direction of sweep 0, NONE with no stops planned
     Queue queue;
-    int queue_size;
+    int *arrivals;                   // Predicted pickup time per floor and direction, see
+                                     // refresh_arrivals() in controller.c
+    int *arrivals_next;              // Where the next table is built, after arrivals
+    uint8_t dispatchable;            // 1 if calls may be given to it
+    unsigned version;                // Odd while arrivals and dispatchable are rewritten
+    size_t registry_slot;            // Its place in the registry's car list, see registry.c
+    unsigned refs;                   // The registry's hold plus work posted to its shard
+    Trip *waiting;                   // Assigned passengers not yet picked up, handed to other
+    size_t waiting_count;            // cars if this one cannot reach them, see
+    size_t waiting_capacity;         // hand_off_waiting() in controller.c
+    uint8_t out_of_service;          // 1 after EMERGENCY or INDIVIDUAL SERVICE until it registers again
+    uint8_t stalled;                 // 1 while its doors keep reopening without it leaving
+    uint8_t reopens;                 // Door reopenings since it last moved
+    uint8_t silent;                  // 1 while it owes a STATUS past --heartbeat, see car_silent()
 } Car;
 
-void recv_looped(int fd, void *buf, size_t sz) {
+#define MAX_MSG_LEN 1024   // Largest frame body accepted from a peer
+#define MSG_BUF_SIZE 4096  // Must hold at least one maximum-sized frame
+
+// Per-connection receive buffer. Reads pull in as many bytes as are
+// available and frames are handed out as views into the buffer, so steady
+// state receiving does no allocation and no per-frame read() calls.
+typedef struct {
+    char data[MSG_BUF_SIZE + 1]; // +1 so a frame can be NUL-terminated in place
+    size_t start;                // Unconsumed bytes are data[start, end)
+    size_t end;
+    size_t term;                 // Index overwritten by the last frame's NUL
+    char saved;                  // Byte that was there
+    int terminated;
+} msg_buf;
+
+static inline void msg_buf_init(msg_buf *buf) {
+    buf->start = 0;
+    buf->end = 0;
+    buf->terminated = 0;
+}
+
+// Undo the NUL written after the previous frame. Views returned earlier are
+// no longer valid after this.
+static inline void msg_buf_restore(msg_buf *buf) {
+    if (buf->terminated) {
+        buf->data[buf->term] = buf->saved;
+        buf->terminated = 0;
+    }
+}
+
+// Move unconsumed bytes to the front to make room at the end.
+static inline void msg_buf_compact(msg_buf *buf) {
+    if (buf->start == buf->end) {
+        buf->start = buf->end = 0;
+    } else if (buf->start > 0) {
+        memmove(buf->data, buf->data + buf->start, buf->end - buf->start);
+        buf->end -= buf->start;
+        buf->start = 0;
+    }
+}
+
+// Take the next complete frame out of the buffer. Returns 1 and sets
+// *frame to a NUL-terminated view valid until the next msg_buf call, 0 if
+// more bytes are needed, or -1 if the peer sent an oversized frame.
+static inline int msg_buf_frame(msg_buf *buf, char **frame, size_t *len) {
+    msg_buf_restore(buf);
+    size_t avail = buf->end - buf->start;
+    if (avail < sizeof(uint32_t)) {
+        return 0;
+    }
+    uint32_t nlen;
+    memcpy(&nlen, buf->data + buf->start, sizeof(nlen));
+    uint32_t flen = ntohl(nlen);
+    if (flen > MAX_MSG_LEN) {
+        return -1;
+    }
+    if (avail - sizeof(nlen) < flen) {
+        return 0;
+    }
+    char *body = buf->data + buf->start + sizeof(nlen);
+    buf->term = buf->start + sizeof(nlen) + flen;
+    buf->saved = buf->data[buf->term];
+    buf->data[buf->term] = '\0';
+    buf->terminated = 1;
+    buf->start += sizeof(nlen) + flen;
+    *frame = body;
+    if (len != NULL) {
+        *len = flen;
+    }
+    return 1;
+}
+
+// One read() of whatever the socket has into the free space. Returns the
+// read() result.
+static inline ssize_t msg_buf_fill(int fd, msg_buf *buf) {
+    msg_buf_restore(buf);
+    msg_buf_compact(buf);
+    ssize_t received = read(fd, buf->data + buf->end, MSG_BUF_SIZE - buf->end);
+    if (received > 0) {
+        buf->end += received;
+    }
+    return received;
+}
+
+// Copy bytes received by other means (e.g. io_uring) into the buffer.
+// Returns how many fit.
+static inline size_t msg_buf_put(msg_buf *buf, const char *data, size_t len) {
+    msg_buf_restore(buf);
+    msg_buf_compact(buf);
+    if (len > MSG_BUF_SIZE - buf->end) {
+        len = MSG_BUF_SIZE - buf->end;
+    }
+    memcpy(buf->data + buf->end, data, len);
+    buf->end += len;
+    return len;
+}
+
+// Block until the next frame arrives on fd. Returns a view into buf and its
+// length in *len (if not NULL), or NULL on EOF (errno 0), a read error or an
+// oversized frame (EMSGSIZE).
+static inline char *next_msg(int fd, msg_buf *buf, size_t *len) {
+    while (1) {
+        char *frame;
+        int rc = msg_buf_frame(buf, &frame, len);
+        if (rc == 1) {
+            return frame;
+        }
+        if (rc == -1) {
+            errno = EMSGSIZE;
+            return NULL;
+        }
+        ssize_t received = msg_buf_fill(fd, buf);
+        if (received == 0) {
+            errno = 0;
+            return NULL;
+        }
+        if (received == -1 && errno != EINTR) {
+            return NULL;
+        }
+    }
+}
+
+// Read exactly sz bytes. Returns 0, or -1 on EOF or error.
+static inline int recv_looped(int fd, void *buf, size_t sz) {
     char *ptr = buf;
     size_t remain = sz;
     while (remain > 0) {
         ssize_t received = read(fd, ptr, remain);
         if (received == -1) {
-            perror("read()");
-            exit(1);
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         } else if (received == 0) {
-            fprintf(stderr, "Connection closed by peer\n");
-            exit(1);
+            return -1;
         }
         ptr += received;
         remain -= received;
     }
+    return 0;
 }
 
-char *receive_msg(int fd) {
+// Read one frame into a freshly allocated string, for one-shot clients.
+// Returns NULL on EOF, error or an oversized frame.
+static inline char *receive_msg(int fd) {
     uint32_t nlen;
-    recv_looped(fd, &nlen, sizeof(nlen));
+    if (recv_looped(fd, &nlen, sizeof(nlen)) == -1) {
+        return NULL;
+    }
     uint32_t len = ntohl(nlen);
+    if (len > MAX_MSG_LEN) {
+        return NULL;
+    }
     char *buf = malloc(len + 1);
     if (buf == NULL) {
-        perror("malloc");
-        exit(1);
+        return NULL;
     }
     buf[len] = '\0';
-    recv_looped(fd, buf, len);
+    if (recv_looped(fd, buf, len) == -1) {
+        free(buf);
+        return NULL;
+    }
     return buf;
 }
 
-void send_looped(int fd, const void *buf, size_t sz)
+// Write exactly sz bytes. Returns 0, or -1 if the peer has gone away.
+static inline int send_looped(int fd, const void *buf, size_t sz)
 {
     const char *ptr = buf;
     size_t remain = sz;
@@ -112,19 +273,104 @@ void send_looped(int fd, const void *buf, size_t sz)
     while (remain > 0) {
         ssize_t sent = write(fd, ptr, remain);
         if (sent == -1) {
-            perror("write()");
-            exit(1);
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
         }
         ptr += sent;
         remain -= sent;
     }
+    return 0;
+}
+
+// Send the length header and the body with a single writev() so a frame
+// never goes out as two segments. Returns 0, or -1 if the peer has gone away.
+static inline int send_frame(int fd, const void *buf, size_t len)
+{
+    uint32_t nlen = htonl(len);
+    struct iovec iov[2] = {
+        { .iov_base = &nlen, .iov_len = sizeof(nlen) },
+        { .iov_base = (void *)buf, .iov_len = len }
+    };
+    struct iovec *vec = iov;
+    int count = 2;
+
+    while (count > 0) {
+        ssize_t sent = writev(fd, vec, count);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        while (count > 0 && (size_t)sent >= vec->iov_len) {
+            sent -= vec->iov_len;
+            vec++;
+            count--;
+        }
+        if (count > 0) {
+            vec->iov_base = (char *)vec->iov_base + sent;
+            vec->iov_len -= sent;
+        }
+    }
+    return 0;
 }
 
-void send_message(int fd, const char *buf)
+static inline int send_message(int fd, const char *buf)
+{
+    return send_frame(fd, buf, strlen(buf));
+}
+
+#define CONTROLLER_PORT 3000
+#define CONTROLLER_SOCKET_ENV "ELEVATOR_SOCKET" // Unix socket path for local clients
+
+// Connect to the controller over the Unix domain socket at unix_path, or at
+// $ELEVATOR_SOCKET if unix_path is NULL, falling back to TCP on 127.0.0.1.
+// Returns the socket, or -1 with errno set.
+static inline int connect_controller(const char *unix_path)
 {
-    uint32_t len = htonl(strlen(buf));
-    send_looped(fd, &len, sizeof(len));
-    send_looped(fd, buf, strlen(buf));
+    if (unix_path == NULL) {
+        unix_path = getenv(CONTROLLER_SOCKET_ENV);
+    }
+
+    int fd;
+    if (unix_path != NULL && unix_path[0] != '\0') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(unix_path) >= sizeof(addr.sun_path)) {
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        strcpy(addr.sun_path, unix_path);
+        fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd != -1 && connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+            return -1;
+        }
+        return fd;
+    }
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(CONTROLLER_PORT);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd != -1 && connect(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    // STATUS updates are small and must not wait for the previous one to be
+    // acknowledged
+    int opt_enable = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+    return fd;
 }
 
 #endif // CAR_SHARED_MEM_H
\ No newline at end of file
@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "channel.h"
+#include "shm_ring.h"
+
+struct channel {
+    Car *car;
+    shm_channel *shm;
+    pthread_t reader;
+};
+
+static void *channel_reader(void *arg) {
+    struct channel *ch = arg;
+    char record[RING_SLOT_SIZE];
+    int len;
+    while ((len = ring_pop(&ch->shm->to_controller, record)) != -1) {
+        process_car_frame(ch->car, record, len);
+    }
+    return NULL;
+}
+
+struct channel *channel_open(Car *car) {
+    char name[sizeof(SHM_CHANNEL_PREFIX) + sizeof(car->name)];
+    snprintf(name, sizeof(name), SHM_CHANNEL_PREFIX "%s", car->name);
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd == -1) {
+        perror("shm_open");
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(shm_channel)) {
+        fprintf(stderr, "Shared memory channel %s has the wrong size\n", name);
+        close(fd);
+        return NULL;
+    }
+    shm_channel *shm = mmap(NULL, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+
+    struct channel *ch = malloc(sizeof(struct channel));
+    if (ch == NULL) {
+        perror("malloc");
+        munmap(shm, sizeof(shm_channel));
+        return NULL;
+    }
+    ch->car = car;
+    ch->shm = shm;
+    if (pthread_create(&ch->reader, NULL, channel_reader, ch) != 0) {
+        perror("pthread_create()");
+        munmap(shm, sizeof(shm_channel));
+        free(ch);
+        return NULL;
+    }
+    return ch;
+}
+
+int channel_send(struct channel *ch, const void *record, size_t len) {
+    return ring_push(&ch->shm->to_car, record, len);
+}
+
+void channel_close(struct channel *ch) {
+    ring_close(&ch->shm->to_controller);
+    ring_close(&ch->shm->to_car);
+    pthread_join(ch->reader, NULL);
+    munmap(ch->shm, sizeof(shm_channel));
+    free(ch);
+}
@@ -0,0 +1,21 @@
+#ifndef CHANNEL_H
+#define CHANNEL_H
+
+#include <stddef.h>
+#include "controller.h"
+
+// Controller end of a car's shared-memory channel (see shm_ring.h). A reader
+// thread per channel feeds the car's STATUS records to process_car_frame().
+
+// Map the channel the car created and start its reader thread.
+// Returns NULL if the car's shared memory object cannot be mapped.
+struct channel *channel_open(Car *car);
+
+// Queue a record for the car. Returns -1 if the car has stopped reading.
+int channel_send(struct channel *ch, const void *record, size_t len);
+
+// Stop the reader thread and unmap the channel. Must not be called with
+// car->mutex held, the reader may be waiting for it.
+void channel_close(struct channel *ch);
+
+#endif // CHANNEL_H
@@ -3,111 +3,409 @@
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
+#include <sys/time.h>
 #include <pthread.h>
 #include <signal.h>
+#include <sched.h>
+#include <semaphore.h>
 #include <time.h>
 #include "car_shared_mem.h"
+#include "channel.h"
+#include "controller.h"
+#include "coro.h"
+#include "dispatcher.h"
+#include "pool.h"
+#include "protocol.h"
+#include "reactor.h"
+#include "registry.h"
+#include "uring.h"
 #include <stdbool.h>
 
-#define BUFFER_SIZE 1024
-#define PORT 3000
-#define MAX_QUEUE 50
-#define MAX_CARS 10
-#define MAX_FLOOR_LEN 4
 #define NO_MOVEMENT "NONE"
+#define DOOR_CYCLE_DELAYS 3 // A car spends one delay each Opening, Open and Closing
+#define JOINT_ROUNDS 4      // Passes improve_assignment() makes over a batch
+#define STALL_REOPENS 3     // Door reopenings before a car that has not left is stalled
+#define WAITING_INITIAL_CAPACITY 8
+#define CONNECTION_STACK_SIZE (256 * 1024) // Per thread with --io threads
 
-Car cars[MAX_CARS];
-int car_count = 0;
 int server_socket;
-pthread_mutex_t car_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Startup options
+static const char *io_mode = "threads"; // "threads", "epoll", "shards", "uring", "pool" or "coro"
+static int io_threads = REACTOR_THREADS; // Event loop threads, or pool workers
+static const char *unix_path = NULL;    // Also listen on this Unix domain socket
+static int unix_socket = -1;
+static int batch_window_ms = 0;         // Gather calls this long to dispatch them jointly
+static int dispatch_thread = 0;         // Plans are owned by the dispatcher thread, see dispatcher.h
+int idle_timeout_ms = 60000;            // Until the first frame, see controller.h
+int heartbeat_ms = 10000;
 
 struct thread_args {
     int socket;
-    char *initial_message;
 };
 
 void handle_sigint(int sig);
-void log_message(const char *message);
-void *handle_car(void *arg);
-int can_service_floor(Car *car, const char *floor);
-Car *find_available_car(const char *source_floor, const char *destination_floor);
-void *handle_call_pad(void *arg);
+void *handle_connection(void *arg);
+void handle_car(int car_socket, msg_buf *buf, const char *message, size_t len);
+Car *find_available_car(int source_floor, int destination_floor);
+void handle_call_pad(int call_pad_socket, const char *message, size_t len);
+void handle_session(int call_pad_socket, msg_buf *buf);
+void *accept_loop(void *arg);
 void start_server();
-Car* add_car(const char *car_name, const char *lowest_floor, const char *highest_floor, int socket);
-void init_queue(Queue *queue, int capacity);
-void addFloorToQueue(Car *car, char floor, Direction dir);
-bool canAccessFloor(Car car, int floor);
-void processRequest(int sourceFloor, int destFloor, Car cars[], int numCars);
+Car* add_car(const char *car_name, size_t name_len, int lowest_floor, int highest_floor, int socket, struct conn *conn);
+int addCallToQueue(Car *car, int source_floor, int destination_floor);
 void updateCarDestination(Car *car);
+static void hand_off_waiting(Car *car, const char *reason, Trip *trips, size_t count);
+static int format_reply(int batch, Car *const *assigned, size_t count, char *response, size_t size);
+static void handle_events(const dispatch_event *events, size_t count);
+
+int main(int argc, char **argv) {
+    int timeouts_given = 0;
+    if (argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s [--io threads|epoll|shards|uring|pool|coro] [--threads {count}] [--unix {path}] [--batch-window {ms}] [--dispatch inline|thread] [--idle-timeout {ms}] [--heartbeat {ms}]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 1; i < argc - 1; i += 2) {
+        if (strcmp(argv[i], "--io") == 0) io_mode = argv[i + 1];
+        else if (strcmp(argv[i], "--threads") == 0) io_threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--unix") == 0) unix_path = argv[i + 1];
+        else if (strcmp(argv[i], "--batch-window") == 0) batch_window_ms = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--idle-timeout") == 0) {
+            idle_timeout_ms = atoi(argv[i + 1]);
+            timeouts_given = 1;
+        } else if (strcmp(argv[i], "--heartbeat") == 0) {
+            heartbeat_ms = atoi(argv[i + 1]);
+            timeouts_given = 1;
+        } else if (strcmp(argv[i], "--dispatch") == 0) {
+            if (strcmp(argv[i + 1], "inline") != 0 && strcmp(argv[i + 1], "thread") != 0) {
+                fprintf(stderr, "Invalid dispatch mode: %s\n", argv[i + 1]);
+                exit(EXIT_FAILURE);
+            }
+            dispatch_thread = strcmp(argv[i + 1], "thread") == 0;
+        } else {
+            fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (strcmp(io_mode, "threads") != 0 && strcmp(io_mode, "epoll") != 0 &&
+        strcmp(io_mode, "shards") != 0 && strcmp(io_mode, "uring") != 0 &&
+        strcmp(io_mode, "pool") != 0 && strcmp(io_mode, "coro") != 0) {
+        fprintf(stderr, "Invalid I/O mode: %s\n", io_mode);
+        exit(EXIT_FAILURE);
+    }
+    if (idle_timeout_ms < 0 || heartbeat_ms < 0) {
+        fprintf(stderr, "--idle-timeout and --heartbeat take milliseconds, 0 for none\n");
+        exit(EXIT_FAILURE);
+    }
+    // Pool workers and the io_uring thread have no timer wheel to keep them on
+    if (strcmp(io_mode, "pool") == 0 || strcmp(io_mode, "uring") == 0) {
+        if (timeouts_given) {
+            fprintf(stderr, "--idle-timeout and --heartbeat need --io threads, epoll, shards or coro\n");
+            exit(EXIT_FAILURE);
+        }
+        idle_timeout_ms = 0;
+        heartbeat_ms = 0;
+    }
+    // Reactor threads answer many connections each and must not wait
+    if (batch_window_ms > 0 && strcmp(io_mode, "threads") != 0) {
+        fprintf(stderr, "--batch-window needs --io threads\n");
+        exit(EXIT_FAILURE);
+    }
+    // Shards own their cars while the dispatcher thread owns every car, and
+    // io_uring sends are only submitted by its own thread
+    if (dispatch_thread && (batch_window_ms > 0 || strcmp(io_mode, "shards") == 0 ||
+                            strcmp(io_mode, "uring") == 0)) {
+        fprintf(stderr, "--dispatch thread needs --io threads, epoll, pool or coro and no --batch-window\n");
+        exit(EXIT_FAILURE);
+    }
+    if (dispatch_thread) {
+        dispatcher_start(handle_events);
+    }
 
-int main() {
     start_server();
     return 0;
 }
 
-// Initialize queue
-void init_queue(Queue *queue, int capacity) {
-    queue->items = malloc(sizeof(QueueItem) * capacity);
-    queue->size = 0;
-    queue->capacity = capacity;
+static Direction reverse(Direction dir) {
+    return dir == UP ? DOWN : UP;
 }
 
-// Add a floor with a direction to the car's queue
-void addFloorToQueue(Car *car, char floor, Direction dir) {
-    if (car->queue.size < car->queue.capacity) {
-        car->queue.items[car->queue.size++] = (QueueItem){floor, dir};
+// 1 if a car at from travelling in dir has yet to reach floor
+static int is_ahead(int floor, int from, Direction dir) {
+    return dir == UP ? floor > from : floor < from;
+}
+
+// 1 if the car still has to travel against its sweep to reach the first
+// stop, as when it turns around below the start of an upward sweep. It then
+// passes every floor of the sweep in the sweep's direction.
+static int before_sweep(const Queue *queue, Direction direction, int current) {
+    return queue->size > 0 && is_ahead(queue_front(queue)->floor, current, reverse(direction));
+}
+
+// Which sweep, counted from the current one, would pick up a passenger at
+// source travelling in dir: the current sweep if the car has yet to pass
+// the floor on it, otherwise the next one in that direction.
+static int pickup_sweep(const Queue *queue, Direction direction, int current, int status,
+                        int source, Direction dir) {
+    if (queue->size == 0) {
+        return 0;
     }
+    if (dir == direction &&
+        (before_sweep(queue, direction, current) || is_ahead(source, current, dir) ||
+         (source == current && status != BETWEEN))) {
+        return 0;
+    }
+    return dir == reverse(direction) ? 1 : 2;
 }
 
-void processRequest(int sourceFloor, int destFloor, Car cars[], int numCars) {
-    
-    Car *car = find_available_car(sourceFloor, destFloor);
+// Plan a passenger's trip into a car's queue. The pickup goes on the sweep
+// chosen by pickup_sweep() and the drop-off is further along the same sweep,
+// so it always comes after the pickup. A pickup at the floor a car is
+// stopped at is planned too, even with its doors open: the call pad's reply
+// can reach the passenger after they have closed, and sending the car to
+// its own floor holds them open or reopens them. Returns -1 if the queue
+// could not grow to hold the trip.
+static int plan_trip(Queue *queue, Direction *direction, int current, int status,
+                     int source_floor, int destination_floor) {
+    Direction dir = source_floor < destination_floor ? UP : DOWN;
+    int sweep = pickup_sweep(queue, *direction, current, status, source_floor, dir);
+    if (queue->size == 0) {
+        *direction = source_floor == current ? dir : source_floor > current ? UP : DOWN;
+    }
 
-    Direction direction = sourceFloor < destFloor ? UP : DOWN;
+    if (queue_insert(queue, source_floor, dir, sweep) == -1) {
+        return -1;
+    }
+    if (queue_insert(queue, destination_floor, dir, sweep) == -1) {
+        return -1;
+    }
+    *direction = queue_front(queue)->dir;
+    return 0;
+}
 
-    // Insert source floor and destination floor based on the direction
-    if (sourceFloor == car->current_floor) {
-        addFloorToQueue(car, destFloor, direction);
-    } else {
-        addFloorToQueue(car, sourceFloor, direction);
-        addFloorToQueue(car, destFloor, direction);
+
+// Floors travelled between a and b. There is no floor 0, B1 is directly
+// below 1.
+static int floors_between(int a, int b) {
+    int floors = abs(a - b);
+    return (a < 0) != (b < 0) ? floors - 1 : floors;
+}
+
+// Index of a floor and direction in an arrivals table
+static int arrival_slot(int lowest_floor, int floor, Direction dir) {
+    return (floor - lowest_floor) * 2 + dir;
+}
+
+// Fill arrivals with the predicted time, in car delays, until a car could
+// pick up a passenger at each floor it serves travelling each way, if the
+// trip were added to its plan: what is left of its current door cycle, then
+// one delay per floor and a full door cycle at every stop it makes on the
+// way.
+// Pickups on one sweep are planned in the order the sweep passes their
+// floors, so walking the floors in that order only ever moves further along
+// the plan: the table costs one pass over the floors and the plan per
+// sweep.
+static void fill_arrivals(const Queue *queue, Direction direction, int current, int status,
+                          int lowest_floor, int highest_floor, int *arrivals) {
+    int door = status == OPENING ? DOOR_CYCLE_DELAYS :
+               status == OPEN ? DOOR_CYCLE_DELAYS - 1 :
+               status == CLOSING ? 1 : 0;
+    for (int d = UP; d <= DOWN; d++) {
+        Direction dir = d;
+        for (int sweep = 0; sweep <= 2; sweep++) {
+            int eta = door, at = current;
+            size_t passed = 0;
+            for (int i = 0; i <= highest_floor - lowest_floor; i++) {
+                int floor = dir == UP ? lowest_floor + i : highest_floor - i;
+                if (pickup_sweep(queue, direction, current, status, floor, dir) != sweep) {
+                    continue;
+                }
+                for (; passed < queue->size && queue_before(queue, passed, floor, dir, sweep); passed++) {
+                    const QueueItem *stop = queue_at(queue, passed);
+                    eta += floors_between(at, stop->floor) + DOOR_CYCLE_DELAYS;
+                    at = stop->floor;
+                }
+                // A car that has not left the floor holds its doors for the passenger
+                int waiting = passed == 0 && floor == current && status != BETWEEN;
+                arrivals[arrival_slot(lowest_floor, floor, dir)] =
+                    waiting ? 0 : eta + floors_between(at, floor);
+            }
+        }
     }
 }
 
-void updateCarDestination(Car *car) {
-    pthread_mutex_lock(&car->mutex);
-    if (car->queue.size > 0) {
-        QueueItem nextStop = car->queue.items[0];
-        car->direction = nextStop.dir;
-        strcpy(car->current_destination, nextStop.floor);
-        // Shift queue after reaching floor
-        for (int i = 0; i < car->queue.size - 1; i++) {
-            car->queue.items[i] = car->queue.items[i + 1];
+// Bring the car's arrivals up to date after its plan, position, status or
+// connection changed. Dispatching then only has to look a call up in each
+// car's table.
+// The table and dispatchable are published seqlock style so dispatch reads
+// them without car->mutex, see read_arrivals(): version is odd while they
+// are being rewritten. The table is built in arrivals_next first, so that
+// only takes a copy. car->mutex keeps writers to one at a time.
+// Caller must hold car->mutex
+static void refresh_arrivals(Car *car) {
+    int dispatchable = car->socket != -1 && !car->out_of_service && !car->stalled &&
+                       !car->silent;
+    fill_arrivals(&car->queue, car->direction, car->current_floor, car->status,
+                  car->lowest_floor, car->highest_floor, car->arrivals_next);
+    int slots = arrival_slot(car->lowest_floor, car->highest_floor + 1, UP);
+
+    __atomic_store_n(&car->version, car->version + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&car->dispatchable, dispatchable, __ATOMIC_RELAXED);
+    for (int i = 0; i < slots; i++) {
+        __atomic_store_n(&car->arrivals[i], car->arrivals_next[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&car->version, car->version + 1, __ATOMIC_RELEASE);
+}
+
+// Remember a passenger the car is to pick up. One that cannot be remembered
+// is still picked up, but stays with the car if it stops serving calls.
+// Caller must hold car->mutex
+static void add_waiting(Car *car, int source_floor, int destination_floor) {
+    if (car->waiting_count == car->waiting_capacity) {
+        size_t capacity = car->waiting_capacity > 0 ? car->waiting_capacity * 2 : WAITING_INITIAL_CAPACITY;
+        Trip *waiting = realloc(car->waiting, capacity * sizeof(Trip));
+        if (waiting == NULL) {
+            perror("realloc");
+            return;
+        }
+        car->waiting = waiting;
+        car->waiting_capacity = capacity;
+    }
+    car->waiting[car->waiting_count++] = (Trip){ source_floor, destination_floor };
+}
+
+// The car has stopped at floor and leaves in dir, so passengers waiting
+// there to travel that way are on board.
+// Caller must hold car->mutex
+static void board_waiting(Car *car, int floor, Direction dir) {
+    for (size_t i = 0; i < car->waiting_count; ) {
+        Trip *trip = &car->waiting[i];
+        Direction trip_dir = trip->source_floor < trip->destination_floor ? UP : DOWN;
+        if (trip->source_floor == floor && trip_dir == dir) {
+            *trip = car->waiting[--car->waiting_count];
+        } else {
+            i++;
         }
-        car->queue.size--;
     }
-    pthread_mutex_unlock(&car->mutex);
 }
 
+// Take the passengers the car has yet to pick up, to hand them to other
+// cars. The caller frees the returned array.
+// Caller must hold car->mutex
+static Trip *take_waiting(Car *car, size_t *count) {
+    Trip *waiting = car->waiting;
+    *count = car->waiting_count;
+    car->waiting = NULL;
+    car->waiting_count = 0;
+    car->waiting_capacity = 0;
+    return waiting;
+}
 
-Car* add_car(const char *car_name, const char *lowest_floor, const char *highest_floor, int socket) {
-    pthread_mutex_lock(&car_mutex);
-    Car *car = &cars[car_count++];
-    strncpy(car->name, car_name, sizeof(car->name));
-    strncpy(car->lowest_floor, lowest_floor, sizeof(car->lowest_floor));
-    strncpy(car->highest_floor, highest_floor, sizeof(car->highest_floor));
-    strncpy(car->current_floor, lowest_floor, sizeof(car->current_floor)); // Initialize current floor
-    strncpy(car->status, "Closed", sizeof(car->status)); // Initialize status
-    car->socket = socket;
+// Add a passenger's trip to the car's stop queue
+// Caller must hold car->mutex
+int addCallToQueue(Car *car, int source_floor, int destination_floor) {
+    int result = plan_trip(&car->queue, &car->direction, car->current_floor, car->status,
+                           source_floor, destination_floor);
+    if (result == 0) {
+        add_waiting(car, source_floor, destination_floor);
+    }
+    refresh_arrivals(car);
+    return result;
+}
+
+// The car has reached its next stop, drop it from the queue. The caller
+// refreshes its arrivals.
+// Caller must hold car->mutex
+void updateCarDestination(Car *car) {
+    const QueueItem *stop = queue_front(&car->queue);
+    board_waiting(car, stop->floor, stop->dir);
+    queue_pop(&car->queue);
+    const QueueItem *next = queue_front(&car->queue);
+    car->direction = next != NULL ? next->dir : NONE;
+}
+
+
+// Drop a hold on the car. The registry's goes once no dispatch can still
+// be looking at the car, and a call posted to its shard holds it until the
+// call has run.
+static void car_put(Car *car) {
+    if (__atomic_sub_fetch(&car->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    pthread_mutex_destroy(&car->mutex);
+    pthread_cond_destroy(&car->cond);
+    queue_free(&car->queue);
+    free(car->arrivals);
+    free(car->waiting);
+    free(car);
+}
+
+// Returns -1 if the registry could not take the car
+static int publish_car(Car *car) {
+    Car *replaced;
+    if (registry_add(car, &replaced) == -1) {
+        return -1;
+    }
+    if (replaced != NULL) {
+        char message[BUFFER_SIZE];
+        snprintf(message, sizeof(message), "%s registered again, its old connection gets no more calls",
+                 car->name);
+        log_message(message);
+    }
+    return 0;
+}
+
+// Every registration is a new car, including one coming back from
+// individual service or emergency mode: whatever it had planned was handed
+// to other cars when it left.
+Car* add_car(const char *car_name, size_t name_len, int lowest_floor, int highest_floor, int socket, struct conn *conn) {
+    Car *car = calloc(1, sizeof(Car));
+    int slots = arrival_slot(lowest_floor, highest_floor + 1, UP);
+    int *arrivals = malloc(2 * slots * sizeof(int)); // arrivals, then arrivals_next
+    if (car == NULL || arrivals == NULL) {
+        perror("malloc");
+        free(car);
+        free(arrivals);
+        return NULL;
+    }
+    memcpy(car->name, car_name, name_len);
+    car->name[name_len] = '\0';
+    car->lowest_floor = lowest_floor;
+    car->highest_floor = highest_floor;
     pthread_mutex_init(&car->mutex, NULL);
     pthread_cond_init(&car->cond, NULL);
-    init_queue(&car->queue, MAX_QUEUE);
-    pthread_mutex_unlock(&car_mutex);
+    // At its lowest floor with nothing planned
+    car->current_floor = lowest_floor;
+    car->current_destination = lowest_floor;
+    car->status = CLOSED;
+    car->socket = socket;
+    car->conn = conn;
+    car->shard = -1;
+    car->direction = NONE;
+    queue_init(&car->queue);
+    car->arrivals = arrivals;
+    car->arrivals_next = arrivals + slots;
+    car->refs = 1;
+    refresh_arrivals(car);
+
+    // The registry publishes the car to dispatch, so it goes in last
+    if (dispatch_thread) {
+        dispatch_event event = { .type = CAR_JOIN, .car = car };
+        dispatcher_push(&event);
+    } else if (publish_car(car) == -1) {
+        car_put(car);
+        return NULL;
+    }
     return car;
 }
 
 void handle_sigint(int sig) {
     close(server_socket);
+    if (unix_socket != -1) {
+        close(unix_socket);
+        unlink(unix_path);
+    }
     printf("Server closed\n");
     exit(0);
 }
@@ -132,171 +430,1201 @@ void log_message(const char *message) {
     printf("[%s] %s\n", time_str, message_copy);
 }
 
-void *handle_car(void *arg) {
-    struct thread_args *args = (struct thread_args *)arg;
-    int car_socket = args->socket;
-    char *buffer = args->initial_message;
-    free(args);
-    
-    if (buffer == NULL) {
-        perror("No initial message");
-        close(car_socket);
-        return NULL;
-    }
-
+Car *register_car(const char *message, size_t len, int socket, struct conn *conn) {
     // Parse car information
-    char car_name[256], lowest_floor[4], highest_floor[4];
-    if (sscanf(buffer, "CAR %s %s %s", car_name, lowest_floor, highest_floor) != 3) {
-        fprintf(stderr, "Error parsing car information: %s\n", buffer);
-        free(buffer);
-        close(car_socket);
+    car_msg msg;
+    if (parse_car(message, len, &msg) == -1) {
+        fprintf(stderr, "Error parsing car information: %.*s\n", (int)len, message);
         return NULL;
     }
 
     // Add car to the list
-    Car *car = add_car(car_name, lowest_floor, highest_floor, car_socket);
-    free(buffer);
+    Car *car = add_car(msg.name, msg.name_len, msg.lowest_floor, msg.highest_floor, socket, conn);
 
-    // Process car commands
+    // Acknowledge binary records, the car switches once it sees this
+    if (car != NULL && msg.binary) {
+        pthread_mutex_lock(&car->mutex);
+        car->binary = 1;
+        car_send(car, BINARY_OPTION);
+        pthread_mutex_unlock(&car->mutex);
+    }
+
+    // Likewise for the shared-memory channel, if it can be mapped. Not with
+    // --io uring: the channel's reader thread handles the car's STATUS and
+    // may send to other cars, and only the ring thread may queue their
+    // output. The car stays on its socket.
+    if (car != NULL && msg.shm && strcmp(io_mode, "uring") != 0) {
+        struct channel *channel = channel_open(car);
+        if (channel != NULL) {
+            pthread_mutex_lock(&car->mutex);
+            car->channel = channel;
+            car_send(car, SHM_OPTION);
+            pthread_mutex_unlock(&car->mutex);
+        }
+    }
+    return car;
+}
+
+// The car's connection has closed and it no longer gets calls. Passengers
+// it was on its way to are given to the cars still connected, then it
+// leaves the registry. Passengers already aboard are lost with it.
+static void remove_car(Car *car) {
+    pthread_mutex_lock(&car->mutex);
+    size_t count;
+    Trip *trips = take_waiting(car, &count);
+    pthread_mutex_unlock(&car->mutex);
+
+    if (count > 0) {
+        hand_off_waiting(car, "has disconnected", trips, count);
+    } else {
+        free(trips);
+    }
+    registry_remove(car, car_put);
+}
+
+void car_disconnected(Car *car) {
+    pthread_mutex_lock(&car->mutex);
+    car->socket = -1;
+    car->conn = NULL;
+    struct channel *channel = car->channel;
+    car->channel = NULL;
+    refresh_arrivals(car);
+    pthread_mutex_unlock(&car->mutex);
+
+    if (channel != NULL) {
+        channel_close(channel);
+    }
+    if (dispatch_thread) {
+        dispatch_event event = { .type = CAR_LEAVE, .car = car };
+        dispatcher_push(&event);
+    } else {
+        remove_car(car);
+    }
+}
+
+void car_send_frame(Car *car, const void *frame, size_t len) {
+    if (car->conn != NULL) {
+        conn_send_frame(car->conn, frame, len);
+    } else if (car->socket != -1) {
+        send_frame(car->socket, frame, len);
+    }
+}
+
+void car_send(Car *car, const char *message) {
+    car_send_frame(car, message, strlen(message));
+}
+
+// The only place the controller turns a floor back into text
+void car_send_floor(Car *car, int floor) {
+    if (car->channel != NULL) {
+        wire_floor record = { WIRE_FLOOR, 0, wire_floor_encode(floor) };
+        if (channel_send(car->channel, &record, sizeof(record)) == -1) {
+            fprintf(stderr, "Shared memory channel to %s is full\n", car->name);
+        }
+    } else if (car->binary) {
+        wire_floor record = { WIRE_FLOOR, 0, wire_floor_encode(floor) };
+        car_send_frame(car, &record, sizeof(record));
+    } else {
+        char name[MAX_FLOOR_LEN];
+        char command[BUFFER_SIZE];
+        floor_name(floor, name, sizeof(name));
+        snprintf(command, sizeof(command), "FLOOR %s", name);
+        car_send(car, command);
+    }
+}
+
+// Tell the car to head for the first stop in its queue
+// Caller must hold car->mutex
+static void send_next_stop(Car *car) {
+    car->current_destination = queue_front(&car->queue)->floor;
+    car->floor_sent = car->current_destination;
+    car->floor_acked = 0;
+    car_send_floor(car, car->current_destination);
+}
+
+// Apply a parsed STATUS update. The car is only sent a FLOOR when its next
+// stop changes: when its doors open at the current one, or when it has
+// taken its last FLOOR and closed its doors without stopping at its next
+// stop.
+//
+// A STATUS may have been sent before the last FLOOR reached the car: with
+// --dispatch thread a car's updates and the calls that change its plan are
+// queued by different threads. The car takes a FLOOR as its destination
+// at once and only reports changes, so the first update that differs from
+// the last one applied and carries floor_sent as its destination is the
+// car acknowledging it. Until then the car's status says nothing about
+// whether it got the FLOOR.
+static void update_status(Car *car, int status, int current_floor, int destination_floor) {
+    pthread_mutex_lock(&car->mutex);
+
+    // Doors that keep reopening at a floor the car has no stop for, as when
+    // they are obstructed, hold up everyone waiting for it. Reopening for a
+    // new stop at the floor does not count.
+    const QueueItem *head = queue_front(&car->queue);
+    if (status == OPENING && car->status == CLOSING && current_floor == car->current_floor &&
+        (head == NULL || head->floor != current_floor)) {
+        car->reopens++;
+    } else if (status == BETWEEN) {
+        car->reopens = 0;
+        car->stalled = 0;
+    }
+    Trip *stranded = NULL;
+    size_t stranded_count = 0;
+    int stalled = car->stalled;
+    if (!car->stalled && car->reopens >= STALL_REOPENS) {
+        car->stalled = 1;
+        stranded = take_waiting(car, &stranded_count);
+    }
+    // A car that went silent is back
+    int silent = car->silent;
+    car->silent = 0;
+
+    // Update car status
+    int repeat = status == car->status && current_floor == car->current_floor &&
+                 destination_floor == car->current_destination;
+    if (!repeat && destination_floor == car->floor_sent) {
+        car->floor_acked = 1;
+    }
+    int moved = status != car->status || current_floor != car->current_floor ||
+                car->stalled != stalled || silent;
+    car->status = status;
+    car->current_floor = current_floor;
+    car->current_destination = destination_floor;
+
+    const QueueItem *next = queue_front(&car->queue);
+    if (next != NULL && (status == OPENING || status == OPEN) && current_floor == next->floor) {
+        updateCarDestination(car);
+        refresh_arrivals(car);
+        if (queue_front(&car->queue) != NULL) {
+            send_next_stop(car);
+        }
+    } else {
+        if (moved) {
+            refresh_arrivals(car);
+        }
+        if (next != NULL && status == CLOSED && car->floor_acked &&
+            (next->floor != car->floor_sent || current_floor == next->floor)) {
+            // Its next stop changed without a FLOOR, or it was sent back to
+            // its own floor while the doors were open and closed them
+            // without reopening
+            send_next_stop(car);
+        }
+    }
+
+    pthread_mutex_unlock(&car->mutex);
+
+    if (stranded_count > 0) {
+        hand_off_waiting(car, "is stalled", stranded, stranded_count);
+    } else {
+        free(stranded);
+    }
+}
+
+// The car has gone into emergency or individual service mode and stops
+// following the controller until it registers again. Its plan is dropped
+// and the passengers it was on its way to are given to other cars.
+static void take_out_of_service(Car *car, const char *reason) {
+    pthread_mutex_lock(&car->mutex);
+    car->out_of_service = 1;
+    size_t count;
+    Trip *trips = take_waiting(car, &count);
+    queue_free(&car->queue);
+    car->direction = NONE;
+    refresh_arrivals(car);
+    pthread_mutex_unlock(&car->mutex);
+
+    hand_off_waiting(car, reason, trips, count);
+}
+
+// The car has sent nothing for heartbeat_ms, see car_silent()
+static void check_silent(Car *car) {
+    pthread_mutex_lock(&car->mutex);
+    // Cars on a shared-memory channel report through it, not the socket
+    if (car->silent || car->out_of_service || car->channel != NULL ||
+        (queue_front(&car->queue) == NULL && car->status == CLOSED)) {
+        pthread_mutex_unlock(&car->mutex);
+        return;
+    }
+    car->silent = 1;
+    size_t count;
+    Trip *trips = take_waiting(car, &count);
+    refresh_arrivals(car);
+    pthread_mutex_unlock(&car->mutex);
+
+    hand_off_waiting(car, "has stopped reporting", trips, count);
+}
+
+// Apply a STATUS update, or have the dispatcher thread apply it
+static void car_status(Car *car, int status, int current_floor, int destination_floor) {
+    if (dispatch_thread) {
+        dispatch_event event = { .type = CAR_STATUS, .car = car, .status = status,
+                                 .current_floor = current_floor, .destination_floor = destination_floor };
+        dispatcher_push(&event);
+    } else {
+        update_status(car, status, current_floor, destination_floor);
+    }
+}
+
+static void car_out_of_service(Car *car, const char *reason) {
+    if (dispatch_thread) {
+        dispatch_event event = { .type = CAR_OUT_OF_SERVICE, .car = car, .reason = reason };
+        dispatcher_push(&event);
+    } else {
+        take_out_of_service(car, reason);
+    }
+}
+
+void car_silent(Car *car) {
+    if (dispatch_thread) {
+        dispatch_event event = { .type = CAR_SILENT, .car = car };
+        dispatcher_push(&event);
+    } else {
+        check_silent(car);
+    }
+}
+
+void process_status(Car *car, const char *message, size_t len) {
+    status_msg msg;
+    if (parse_status(message, len, &msg) == -1) {
+        fprintf(stderr, "Error parsing status update: %.*s\n", (int)len, message);
+        return;
+    }
+    car_status(car, msg.status, msg.current_floor, msg.destination_floor);
+}
+
+void process_status_record(Car *car, const char *frame, size_t len) {
+    wire_status record;
+    if (len != sizeof(record)) {
+        fprintf(stderr, "Error parsing binary status update from %s\n", car->name);
+        return;
+    }
+    memcpy(&record, frame, sizeof(record));
+    if (record.type != WIRE_STATUS || status_name(record.status) == NULL) {
+        fprintf(stderr, "Error parsing binary status update from %s\n", car->name);
+        return;
+    }
+    car_status(car, record.status, wire_floor_decode(record.current_floor),
+               wire_floor_decode(record.destination_floor));
+}
+
+void process_car_frame(Car *car, const char *frame, size_t len) {
+    if (is_binary_frame(frame, len)) {
+        process_status_record(car, frame, len);
+        return;
+    }
+    switch (message_type(frame, len)) {
+    case MSG_STATUS:
+        process_status(car, frame, len);
+        break;
+    case MSG_EMERGENCY:
+        car_out_of_service(car, "is in emergency mode");
+        break;
+    case MSG_INDIVIDUAL_SERVICE:
+        car_out_of_service(car, "is in individual service mode");
+        break;
+    default:
+        break;
+    }
+}
+
+// Have reads on the socket give up with EAGAIN after ms, 0 to wait forever
+static void set_receive_timeout(int socket, int ms) {
+    struct timeval tv = { ms / 1000, (ms % 1000) * 1000 };
+    if (setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1) {
+        perror("setsockopt()");
+    }
+}
+
+void handle_car(int car_socket, msg_buf *buf, const char *message, size_t len) {
+    Car *car = register_car(message, len, car_socket, NULL);
+    if (car == NULL) {
+        return;
+    }
+
+    // Process car commands, checking on the car whenever it goes quiet
+    set_receive_timeout(car_socket, heartbeat_ms);
     while (1) {
-        buffer = receive_msg(car_socket);
-        if (!buffer) {
+        message = next_msg(car_socket, buf, &len);
+        if (message != NULL) {
+            process_car_frame(car, message, len);
+        } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            car_silent(car);
+        } else {
             break;
         }
+    }
+
+    // Stop call pads sending to the socket once it is closed
+    car_disconnected(car);
+}
+
+// What dispatching needs to know about a car, read once per batch: its
+// predicted arrival for each call. A car chosen for a call with more calls
+// still to place gets a private copy of its plan with the call added, and
+// later calls are looked up in the arrivals that follow from that instead.
+typedef struct {
+    Car *car;
+    int available;
+    int lowest_floor;
+    int highest_floor;
+    int arrival[MAX_CALL_BATCH];
+    int *arrivals;   // Set once the car has a private plan
+    Queue queue;
+    Direction direction;
+    int have_base;   // Set once base holds the car's plan without the batch
+    Queue base;
+    Direction base_direction;
+    int current_floor;
+    int status;
+    int wait;        // Predicted wait of the batch's calls given to the car
+} car_snapshot;
+
+static int serves(const car_snapshot *s, int source_floor, int destination_floor) {
+    return source_floor >= s->lowest_floor && source_floor <= s->highest_floor &&
+           destination_floor >= s->lowest_floor && destination_floor <= s->highest_floor;
+}
+
+static Direction trip_direction(const call_msg *call) {
+    return call->source_floor < call->destination_floor ? UP : DOWN;
+}
+
+static int arrival_slots(const car_snapshot *s) {
+    return arrival_slot(s->lowest_floor, s->highest_floor + 1, UP);
+}
+
+// Copy the car's plan, as it is before the batch, into the snapshot.
+// Returns -1 if it could not be allocated.
+static int take_base(car_snapshot *s) {
+    if (s->have_base) {
+        return 0;
+    }
+    Car *car = s->car;
+    pthread_mutex_lock(&car->mutex);
+    int result = queue_copy(&s->base, &car->queue);
+    s->base_direction = car->direction;
+    s->current_floor = car->current_floor;
+    s->status = car->status;
+    pthread_mutex_unlock(&car->mutex);
+    s->have_base = result == 0;
+    return result;
+}
+
+// Give a car chosen in this batch a private plan and arrivals to add its
+// calls to. Returns -1 if they could not be allocated.
+static int plan_privately(car_snapshot *s) {
+    s->arrivals = malloc(arrival_slots(s) * sizeof(int));
+    if (s->arrivals == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    if (take_base(s) == -1 || queue_copy(&s->queue, &s->base) == -1) {
+        return -1;
+    }
+    s->direction = s->base_direction;
+    return 0;
+}
+
+// 1 if fleet car i has calls[c] once calls[skip] is taken from it and
+// calls[extra] given to it
+static int takes_call(const int *choice, size_t c, int i, int skip, int extra) {
+    return (int)c == extra || (choice[c] == i && (int)c != skip);
+}
+
+// Predicted wait, in car delays, of the calls in the batch given to fleet
+// car i with calls[skip] taken away and calls[extra] added (-1 for
+// neither). The calls are planned into a copy of the car's plan in batch
+// order and each one's wait read from the arrivals that result, so a call
+// that holds up an earlier one is charged for it. Returns -1 if the plan
+// could not be copied or grown.
+static int batch_wait(car_snapshot *s, int i, const call_msg *calls, const int *choice,
+                      size_t count, int skip, int extra, int *arrivals) {
+    int planned = 0;
+    for (size_t c = 0; c < count; c++) {
+        planned |= takes_call(choice, c, i, skip, extra);
+    }
+    if (!planned) {
+        return 0;
+    }
+    Queue plan;
+    if (take_base(s) == -1 || queue_copy(&plan, &s->base) == -1) {
+        return -1;
+    }
+    Direction direction = s->base_direction;
+    int result = 0;
+    for (size_t c = 0; c < count && result == 0; c++) {
+        if (takes_call(choice, c, i, skip, extra)) {
+            result = plan_trip(&plan, &direction, s->current_floor, s->status,
+                               calls[c].source_floor, calls[c].destination_floor);
+        }
+    }
+    if (result == 0) {
+        fill_arrivals(&plan, direction, s->current_floor, s->status,
+                      s->lowest_floor, s->highest_floor, arrivals);
+        for (size_t c = 0; c < count; c++) {
+            if (takes_call(choice, c, i, skip, extra)) {
+                result += arrivals[arrival_slot(s->lowest_floor, calls[c].source_floor,
+                                                trip_direction(&calls[c]))];
+            }
+        }
+    }
+    queue_free(&plan);
+    return result;
+}
+
+// Improve a batch's assignment jointly: the greedy pass never revisits a
+// call, so an early call can take the car a later one needed more, and a
+// later call can be planned in front of an earlier one on the same car.
+// Move one call at a time to the car where it lowers the batch's total
+// predicted wait the most, until no move helps or JOINT_ROUNDS passes are
+// done. choice[c] is the fleet index of the car calls[c] is given to, or -1.
+static void improve_assignment(car_snapshot *fleet, int n, const call_msg *calls, size_t count,
+                               int *choice) {
+    int slots = 0;
+    for (int i = 0; i < n; i++) {
+        fleet[i].wait = 0;
+        if (fleet[i].available && arrival_slots(&fleet[i]) > slots) {
+            slots = arrival_slots(&fleet[i]);
+        }
+    }
+    if (slots == 0) {
+        return;
+    }
+    int *arrivals = malloc(slots * sizeof(int));
+    if (arrivals == NULL) {
+        perror("malloc");
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        if (fleet[i].available &&
+            (fleet[i].wait = batch_wait(&fleet[i], i, calls, choice, count, -1, -1, arrivals)) == -1) {
+            fleet[i].available = 0;
+        }
+    }
 
-        // Handle STATUS command
-        if (strncmp(buffer, "STATUS", 6) == 0) {
-            char status[8], current_floor[4], destination_floor[4];
-            if (sscanf(buffer, "STATUS %s %s %s", status, current_floor, destination_floor) != 3) {
-                fprintf(stderr, "Error parsing status update: %s\n", buffer);
-                free(buffer);
+    int moved = 1;
+    for (int round = 0; moved && round < JOINT_ROUNDS; round++) {
+        moved = 0;
+        for (size_t c = 0; c < count; c++) {
+            int from = choice[c];
+            if (from == -1 || !fleet[from].available) {
                 continue;
             }
+            // Only worked out once another car could take the call
+            int without = -1;
+            int best_gain = 0, best = -1, best_wait = 0;
+            for (int i = 0; i < n; i++) {
+                car_snapshot *s = &fleet[i];
+                if (i == from || !s->available ||
+                    !serves(s, calls[c].source_floor, calls[c].destination_floor)) {
+                    continue;
+                }
+                if (without == -1 &&
+                    (without = batch_wait(&fleet[from], from, calls, choice, count, c, -1, arrivals)) == -1) {
+                    break;
+                }
+                int with = batch_wait(s, i, calls, choice, count, -1, c, arrivals);
+                if (with == -1) {
+                    continue;
+                }
+                int gain = fleet[from].wait + s->wait - without - with;
+                if (gain > best_gain) {
+                    best_gain = gain;
+                    best = i;
+                    best_wait = with;
+                }
+            }
+            if (best != -1) {
+                fleet[from].wait = without;
+                fleet[best].wait = best_wait;
+                choice[c] = best;
+                moved = 1;
+            }
+        }
+    }
+    free(arrivals);
+}
 
-            pthread_mutex_lock(&car->mutex);
-            
-            // Update car status
-            strncpy(car->status, status, sizeof(car->status));
-            strncpy(car->current_floor, current_floor, sizeof(car->current_floor));
-            strncpy(car->current_destination, destination_floor, sizeof(car->current_destination));
-
-            // Handle different car states
-            if (strcmp(status, "Closed") == 0 && strcmp(car->current_floor, car->current_destination) == 0) {
-                updateCarDestination(car);
+// Read the car's arrivals for each call it serves into s, without taking
+// car->mutex: STATUS updates never wait for dispatch. A read that overlaps
+// refresh_arrivals() is retried. A car's floors and its table never change
+// once it is registered.
+static void read_arrivals(Car *car, car_snapshot *s, const call_msg *calls, size_t count) {
+    unsigned version;
+    do {
+        while ((version = __atomic_load_n(&car->version, __ATOMIC_ACQUIRE)) & 1) {
+            sched_yield();
+        }
+        s->available = __atomic_load_n(&car->dispatchable, __ATOMIC_RELAXED);
+        for (size_t c = 0; s->available && c < count; c++) {
+            if (serves(s, calls[c].source_floor, calls[c].destination_floor)) {
+                s->arrival[c] = __atomic_load_n(&car->arrivals[arrival_slot(car->lowest_floor,
+                                                    calls[c].source_floor, trip_direction(&calls[c]))],
+                                                __ATOMIC_RELAXED);
             }
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while (__atomic_load_n(&car->version, __ATOMIC_RELAXED) != version);
+}
 
-            char response[BUFFER_SIZE];
-            snprintf(response, BUFFER_SIZE, "FLOOR %s", car->current_destination);
-            send_message(car_socket, response);
+// Choose a car for each call in one pass over the fleet, reading each car's
+// arrivals once per batch rather than once per call. The registry is walked
+// without a lock; the caller must be between registry_enter() and
+// registry_exit() until it is done with the cars it is given.
+// Each call goes to the connected car serving both floors that is predicted
+// to reach the passenger first, including cars already on a trip, whose
+// queue the call joins. That is a lookup in each car's arrivals, kept up to
+// date by refresh_arrivals(), so a single call costs the same however much
+// is planned. In a batch each call is first placed as if the calls had been
+// made one at a time with no STATUS in between, then improve_assignment()
+// trades calls between cars.
+// assigned[i] is NULL if no car can take calls[i].
+static void dispatch_calls(const call_msg *calls, size_t count, Car **assigned) {
+    int choice[MAX_CALL_BATCH];
+    size_t registered;
+    Car *const *cars = registry_cars(&registered);
+    car_snapshot *fleet = malloc((registered > 0 ? registered : 1) * sizeof(car_snapshot));
+    if (fleet == NULL) {
+        perror("malloc");
+        memset(assigned, 0, count * sizeof(assigned[0]));
+        return;
+    }
 
-            pthread_mutex_unlock(&car->mutex);
+    // Only cars that could take one of the calls are kept
+    int n = 0;
+    for (size_t i = 0; i < registered; i++) {
+        Car *car = registry_car(cars, i);
+        if (car == NULL) {
+            continue;
         }
-    }     
-    close(car_socket);
-    return NULL;
+        car_snapshot *s = &fleet[n];
+        s->lowest_floor = car->lowest_floor;
+        s->highest_floor = car->highest_floor;
+        size_t c = 0;
+        while (c < count && !serves(s, calls[c].source_floor, calls[c].destination_floor)) {
+            c++;
+        }
+        if (c == count) {
+            continue;
+        }
+        read_arrivals(car, s, calls, count);
+        if (!s->available) {
+            continue;
+        }
+        s->car = car;
+        s->arrivals = NULL;
+        s->have_base = 0;
+        queue_init(&s->queue);
+        queue_init(&s->base);
+        n++;
+    }
+
+    for (size_t c = 0; c < count; c++) {
+        int source = calls[c].source_floor, destination = calls[c].destination_floor;
+        int best = __INT_MAX__;
+        choice[c] = -1;
+        for (int i = 0; i < n; i++) {
+            car_snapshot *s = &fleet[i];
+            if (!s->available || !serves(s, source, destination)) {
+                continue;
+            }
+            int eta = s->arrivals != NULL
+                ? s->arrivals[arrival_slot(s->lowest_floor, source, trip_direction(&calls[c]))]
+                : s->arrival[c];
+            if (eta < best) {
+                best = eta;
+                choice[c] = i;
+            }
+        }
+
+        // The private plan only matters to later calls in the batch
+        if (choice[c] == -1 || c + 1 == count) {
+            continue;
+        }
+        car_snapshot *chosen = &fleet[choice[c]];
+        if ((chosen->arrivals == NULL && plan_privately(chosen) == -1) ||
+            plan_trip(&chosen->queue, &chosen->direction, chosen->current_floor, chosen->status,
+                      source, destination) == -1) {
+            chosen->available = 0;
+            continue;
+        }
+        fill_arrivals(&chosen->queue, chosen->direction, chosen->current_floor, chosen->status,
+                      chosen->lowest_floor, chosen->highest_floor, chosen->arrivals);
+    }
+
+    if (count > 1) {
+        improve_assignment(fleet, n, calls, count, choice);
+    }
+    for (size_t c = 0; c < count; c++) {
+        assigned[c] = choice[c] != -1 ? fleet[choice[c]].car : NULL;
+    }
+
+    for (int i = 0; i < n; i++) {
+        queue_free(&fleet[i].queue);
+        queue_free(&fleet[i].base);
+        free(fleet[i].arrivals);
+    }
+    free(fleet);
 }
 
-int can_service_floor(Car *car, const char *floor) {
-    int floor_num = atoi(floor);
-    int lowest_floor_num = atoi(car->lowest_floor);
-    int highest_floor_num = atoi(car->highest_floor);
+// Caller must be between registry_enter() and registry_exit()
+Car *find_available_car(int source_floor, int destination_floor) {
+    call_msg call = { source_floor, destination_floor };
+    Car *selected_car;
+    dispatch_calls(&call, 1, &selected_car);
+    return selected_car;
+}
 
-    if (floor[0] == 'B') {
-        floor_num = -atoi(floor + 1);
+// Add a call the car has been assigned to its stop queue, and redirect the
+// car if the call changed its next stop
+static void assign_call_local(Car *car, int source_floor, int destination_floor) {
+    pthread_mutex_lock(&car->mutex);
+    if (car->socket == -1) {
+        // Disconnected since it was chosen, and remove_car() may already
+        // have handed off its waiting passengers
+        pthread_mutex_unlock(&car->mutex);
+        Trip *trip = malloc(sizeof(Trip));
+        if (trip == NULL) {
+            perror("malloc");
+            return;
+        }
+        *trip = (Trip){ source_floor, destination_floor };
+        hand_off_waiting(car, "has disconnected", trip, 1);
+        return;
     }
-    if (car->lowest_floor[0] == 'B') {
-        lowest_floor_num = -atoi(car->lowest_floor + 1);
+    const QueueItem *next = queue_front(&car->queue);
+    int had_stop = next != NULL;
+    int next_floor = had_stop ? next->floor : 0;
+    if (addCallToQueue(car, source_floor, destination_floor) == -1) {
+        fprintf(stderr, "Could not plan a trip for %s\n", car->name);
+    } else if (!had_stop || queue_front(&car->queue)->floor != next_floor) {
+        send_next_stop(car);
     }
-    if (car->highest_floor[0] == 'B') {
-        highest_floor_num = -atoi(car->highest_floor + 1);
+    pthread_mutex_unlock(&car->mutex);
+}
+
+static void assign_call_posted(Car *car, int source_floor, int destination_floor) {
+    assign_call_local(car, source_floor, destination_floor);
+    car_put(car);
+}
+
+// With --io shards only the shard that owns the car touches it. A posted
+// call runs after the caller has left the registry, so it holds the car.
+// Caller must be between registry_enter() and registry_exit()
+static void assign_call(Car *car, int source_floor, int destination_floor) {
+    int shard = __atomic_load_n(&car->shard, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&car->refs, 1, __ATOMIC_RELAXED);
+    if (reactor_post(shard, assign_call_posted, car, source_floor, destination_floor) == -1) {
+        __atomic_sub_fetch(&car->refs, 1, __ATOMIC_RELAXED);
+        assign_call_local(car, source_floor, destination_floor);
     }
+}
+
+// With --batch-window single calls are not dispatched as they arrive but
+// gathered for that long and dispatched together, so the whole window is
+// assigned jointly. The first call in a window waits it out, dispatches and
+// assigns every call in it, writes their replies and wakes the others.
+// Each call pad connection has its own thread with --io threads, the only
+// mode the window is allowed in, so the wait holds up nobody else.
+//
+// Nobody holds a registry epoch while the window is open: windows follow
+// each other under steady traffic, and an epoch held across them would
+// keep cars that have left from ever being freed. The leader only enters
+// the registry once the window has closed.
+struct pending_call {
+    call_msg call;
+    char *response;   // Written by the window's leader
+    size_t size;
+    int done;
+};
 
-    return floor_num >= lowest_floor_num && floor_num <= highest_floor_num;
+static pthread_mutex_t window_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t window_cond = PTHREAD_COND_INITIALIZER;
+static struct pending_call *window[MAX_CALL_BATCH];
+static size_t window_count = 0;
+
+static void dispatch_in_window(const call_msg *call, char *response, size_t size) {
+    struct pending_call pending = { *call, response, size, 0 };
+    pthread_mutex_lock(&window_mutex);
+    while (window_count == MAX_CALL_BATCH) {
+        pthread_cond_wait(&window_cond, &window_mutex);
+    }
+    window[window_count++] = &pending;
+    if (window_count > 1) {
+        while (!pending.done) {
+            pthread_cond_wait(&window_cond, &window_mutex);
+        }
+        pthread_mutex_unlock(&window_mutex);
+        return;
+    }
+    pthread_mutex_unlock(&window_mutex);
+
+    struct timespec wait = { batch_window_ms / 1000, (batch_window_ms % 1000) * 1000000L };
+    nanosleep(&wait, NULL);
+
+    // Close the window, later calls start the next one
+    struct pending_call *batch[MAX_CALL_BATCH];
+    pthread_mutex_lock(&window_mutex);
+    size_t count = window_count;
+    memcpy(batch, window, count * sizeof(batch[0]));
+    window_count = 0;
+    pthread_cond_broadcast(&window_cond);
+    pthread_mutex_unlock(&window_mutex);
+
+    call_msg calls[MAX_CALL_BATCH];
+    Car *assigned[MAX_CALL_BATCH];
+    for (size_t i = 0; i < count; i++) {
+        calls[i] = batch[i]->call;
+    }
+    unsigned epoch = registry_enter();
+    dispatch_calls(calls, count, assigned);
+    for (size_t i = 0; i < count; i++) {
+        if (assigned[i] != NULL) {
+            assign_call(assigned[i], calls[i].source_floor, calls[i].destination_floor);
+        }
+        format_reply(0, &assigned[i], 1, batch[i]->response, batch[i]->size);
+    }
+    registry_exit(epoch);
+
+    pthread_mutex_lock(&window_mutex);
+    for (size_t i = 0; i < count; i++) {
+        batch[i]->done = 1;
+    }
+    pthread_cond_broadcast(&window_cond);
+    pthread_mutex_unlock(&window_mutex);
 }
 
-Car *find_available_car(const char *source_floor, const char *destination_floor) {
-    pthread_mutex_lock(&car_mutex);
-    Car *selected_car = NULL;
-    int diff_from_call = __INT_MAX__;
-    int my_car_diff = diff_from_call;
-    for (int i = 0; i < car_count; i++) {
-        pthread_mutex_lock(&cars[i].mutex);
-        if (strcmp(cars[i].status, "Closed") == 0 && can_service_floor(&cars[i], source_floor) && can_service_floor(&cars[i], destination_floor)) {
-            my_car_diff = abs(atoi(source_floor) - atoi(cars[i].current_floor));
-            if (my_car_diff < diff_from_call) {
-                diff_from_call = my_car_diff;
-                selected_car = &cars[i];
+// Dispatch passengers a car can no longer reach to the cars still serving
+// calls. Their call pads were told the first car; the passengers take
+// whichever car stops for them. Frees trips.
+static void hand_off_waiting(Car *car, const char *reason, Trip *trips, size_t count) {
+    char message[BUFFER_SIZE];
+    snprintf(message, sizeof(message), "%s %s, handing %zu waiting passengers to other cars",
+             car->name, reason, count);
+    log_message(message);
+
+    size_t dropped = 0;
+    unsigned epoch = registry_enter();
+    for (size_t start = 0; start < count; start += MAX_CALL_BATCH) {
+        size_t n = count - start < MAX_CALL_BATCH ? count - start : MAX_CALL_BATCH;
+        call_msg calls[MAX_CALL_BATCH];
+        Car *assigned[MAX_CALL_BATCH];
+        for (size_t i = 0; i < n; i++) {
+            calls[i] = (call_msg){ trips[start + i].source_floor, trips[start + i].destination_floor };
+        }
+        dispatch_calls(calls, n, assigned);
+        for (size_t i = 0; i < n; i++) {
+            if (assigned[i] != NULL) {
+                assign_call(assigned[i], calls[i].source_floor, calls[i].destination_floor);
+            } else {
+                dropped++;
             }
         }
-        pthread_mutex_unlock(&cars[i].mutex);
     }
-    pthread_mutex_unlock(&car_mutex);
-    return selected_car;
+    registry_exit(epoch);
+    free(trips);
+
+    if (dropped > 0) {
+        snprintf(message, sizeof(message), "%s %s, %zu waiting passengers could not be handed to another car",
+                 car->name, reason, dropped);
+        log_message(message);
+    }
 }
 
-void *handle_call_pad(void *arg) {
-    struct thread_args *args = (struct thread_args *)arg;
-    int call_pad_socket = args->socket;
-    char *buffer = args->initial_message;
-    free(args);
-    
-    if (buffer == NULL) {
-        perror("No initial message");
-        close(call_pad_socket);
-        return NULL;
+// Answer a call pad for calls dispatched to assigned[]: "CAR {name}" or
+// "UNAVAILABLE" for a CALL, "CARS {name or UNAVAILABLE} ..." in request
+// order for a CALLS batch. Returns -1 if the reply does not fit.
+// Caller must be between registry_enter() and registry_exit()
+static int format_reply(int batch, Car *const *assigned, size_t count, char *response, size_t size) {
+    if (!batch && assigned[0] != NULL) {
+        snprintf(response, size, "CAR %s", assigned[0]->name);
+        return 0;
+    } else if (!batch) {
+        // No available car
+        snprintf(response, size, "UNAVAILABLE");
+        return 0;
+    }
+    size_t used = snprintf(response, size, "CARS");
+    for (size_t i = 0; i < count && used < size; i++) {
+        used += snprintf(response + used, size - used, " %s",
+                         assigned[i] ? assigned[i]->name : "UNAVAILABLE");
+    }
+    if (used >= size) {
+        fprintf(stderr, "Reply to call batch of %zu is too long\n", count);
+        return -1;
     }
+    return 0;
+}
+
+// Caller must be between registry_enter() and registry_exit()
+static void assign_calls(const call_msg *calls, Car *const *assigned, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (assigned[i] != NULL) {
+            assign_call(assigned[i], calls[i].source_floor, calls[i].destination_floor);
+        }
+    }
+}
+
+// A call pad's request for the dispatcher thread to answer. A connection
+// thread (--io threads) waits on done for the answer in its own buffers;
+// event loops hand over conn and the dispatcher thread sends the reply.
+struct call_request {
+    const call_msg *calls;
+    size_t count;
+    int batch;         // A CALLS message, answered with CARS
+    char *response;
+    size_t size;
+    int result;        // What process_call() returns
+    sem_t done;
+    struct conn *conn;
+    size_t prefix;     // Bytes of reply before the answer, a session's request id
+    call_msg stored[MAX_CALL_BATCH]; // With conn, copies of the calls and reply
+    char reply[BUFFER_SIZE];
+};
+
+// Hand calls to the dispatcher thread. The answer goes after the first
+// prefix bytes of response, already filled in. With conn this returns 1 at
+// once; otherwise it waits for the answer.
+static int request_dispatch(const call_msg *calls, size_t count, int batch, char *response,
+                            size_t prefix, size_t size, struct conn *conn) {
+    if (conn == NULL) {
+        struct call_request request = { calls, count, batch, response + prefix, size - prefix, 0 };
+        sem_init(&request.done, 0, 0);
+        dispatch_event event = { .type = NEW_CALL, .request = &request };
+        dispatcher_push(&event);
+        while (sem_wait(&request.done) == -1) {
+        }
+        sem_destroy(&request.done);
+        return request.result;
+    }
+
+    struct call_request *request = malloc(sizeof(struct call_request));
+    if (request == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    memcpy(request->stored, calls, count * sizeof(call_msg));
+    memcpy(request->reply, response, prefix);
+    request->calls = request->stored;
+    request->count = count;
+    request->batch = batch;
+    request->response = request->reply + prefix;
+    request->size = sizeof(request->reply) - prefix;
+    request->conn = conn;
+    request->prefix = prefix;
+    conn_expect_reply(conn);
+    dispatch_event event = { .type = NEW_CALL, .request = request };
+    dispatcher_push(&event);
+    return 1;
+}
+
+// Give a request its answer. Frees it if the dispatcher thread sends it.
+static void answer_request(struct call_request *request) {
+    if (request->conn == NULL) {
+        sem_post(&request->done);
+        return;
+    }
+    if (request->result == -1 && request->prefix > 0) {
+        // A bad request only fails itself, see process_session_frame()
+        snprintf(request->response, request->size, "INVALID");
+        request->result = 0;
+    }
+    conn_reply(request->conn, request->result == 0 ? request->reply : NULL);
+    free(request);
+}
+
+// Answer requests queued one after another together: their calls are
+// dispatched as a single batch, so they are assigned jointly.
+static void answer_requests(const dispatch_event *events, size_t count) {
+    call_msg calls[MAX_CALL_BATCH];
+    Car *assigned[MAX_CALL_BATCH];
+    size_t total = 0;
+    for (size_t i = 0; i < count; i++) {
+        memcpy(calls + total, events[i].request->calls, events[i].request->count * sizeof(call_msg));
+        total += events[i].request->count;
+    }
+
+    unsigned epoch = registry_enter();
+    dispatch_calls(calls, total, assigned);
+    total = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct call_request *request = events[i].request;
+        request->result = format_reply(request->batch, assigned + total, request->count,
+                                       request->response, request->size);
+        // Build the whole reply before committing any car to it
+        if (request->result == 0) {
+            assign_calls(calls + total, assigned + total, request->count);
+        }
+        total += request->count;
+        answer_request(request);
+    }
+    registry_exit(epoch);
+}
+
+// The dispatcher thread's side of --dispatch thread, see dispatcher.h
+static void handle_events(const dispatch_event *events, size_t count) {
+    for (size_t i = 0; i < count; ) {
+        const dispatch_event *event = &events[i];
+        if (event->type == NEW_CALL) {
+            size_t end = i, calls = 0;
+            while (end < count && events[end].type == NEW_CALL &&
+                   calls + events[end].request->count <= MAX_CALL_BATCH) {
+                calls += events[end++].request->count;
+            }
+            answer_requests(&events[i], end - i);
+            i = end;
+            continue;
+        }
+        switch (event->type) {
+        case CAR_STATUS:
+            update_status(event->car, event->status, event->current_floor, event->destination_floor);
+            break;
+        case CAR_JOIN:
+            if (publish_car(event->car) == -1) {
+                fprintf(stderr, "Could not register %s\n", event->car->name);
+            }
+            break;
+        case CAR_LEAVE:
+            remove_car(event->car);
+            break;
+        case CAR_OUT_OF_SERVICE:
+            take_out_of_service(event->car, event->reason);
+            break;
+        case CAR_SILENT:
+            check_silent(event->car);
+            break;
+        default:
+            break;
+        }
+        i++;
+    }
+}
+
+static int process_call_batch_at(const char *message, size_t len, char *response, size_t prefix,
+                                 size_t size, struct conn *conn);
+
+// process_call() answering after the first prefix bytes of response
+static int process_call_at(const char *message, size_t len, char *response, size_t prefix,
+                           size_t size, struct conn *conn) {
+    if (message_type(message, len) == MSG_CALLS) {
+        return process_call_batch_at(message, len, response, prefix, size, conn);
+    }
+
     // Parse call pad request
-    char source_floor[4], destination_floor[4];
-    if (sscanf(buffer, "CALL %s %s", source_floor, destination_floor) != 2) {
-        fprintf(stderr, "Error parsing call pad request: %s\n", buffer);
-        close(call_pad_socket);
-        return NULL;
+    call_msg msg;
+    if (parse_call(message, len, &msg) == -1) {
+        fprintf(stderr, "Error parsing call pad request: %.*s\n", (int)len, message);
+        return -1;
+    }
+    if (dispatch_thread) {
+        return request_dispatch(&msg, 1, 0, response, prefix, size, conn);
+    }
+    response += prefix;
+    size -= prefix;
+
+    if (batch_window_ms > 0) {
+        dispatch_in_window(&msg, response, size);
+        return 0;
     }
 
     // Find an available car
-    Car *selected_car = find_available_car(source_floor, destination_floor);
+    Car *selected_car;
+    unsigned epoch = registry_enter();
+    dispatch_calls(&msg, 1, &selected_car);
+    assign_calls(&msg, &selected_car, 1);
+    format_reply(0, &selected_car, 1, response, size);
+    registry_exit(epoch);
+    return 0;
+}
 
-    if (selected_car) {
-        // Send car name to call pad
-        char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), "CAR %s", selected_car->name);
-        send(call_pad_socket, response, strlen(response), 0);
+int process_call(const char *message, size_t len, char *response, size_t size, struct conn *conn) {
+    return process_call_at(message, len, response, 0, size, conn);
+}
 
-        // Update car destination
-        pthread_mutex_lock(&selected_car->mutex);
-        strncpy(selected_car->current_destination, source_floor, sizeof(selected_car->current_destination));
-        pthread_mutex_unlock(&selected_car->mutex);
+static int process_call_batch_at(const char *message, size_t len, char *response, size_t prefix,
+                                 size_t size, struct conn *conn) {
+    call_msg calls[MAX_CALL_BATCH];
+    size_t count;
+    if (parse_call_batch(message, len, calls, MAX_CALL_BATCH, &count) == -1) {
+        fprintf(stderr, "Error parsing call batch: %.*s\n", (int)len, message);
+        return -1;
+    }
+    if (dispatch_thread) {
+        return request_dispatch(calls, count, 1, response, prefix, size, conn);
+    }
+    response += prefix;
+    size -= prefix;
 
-        // Notify car of new destination
-        char command[BUFFER_SIZE];
-        snprintf(command, sizeof(command), "FLOOR %s", source_floor);
-        send_message(selected_car->socket, command);
-    } else {
-        // No available car
+    Car *assigned[MAX_CALL_BATCH];
+    unsigned epoch = registry_enter();
+    dispatch_calls(calls, count, assigned);
+    // Build the whole reply before committing any car to it
+    int result = format_reply(1, assigned, count, response, size);
+    if (result == 0) {
+        assign_calls(calls, assigned, count);
+    }
+    registry_exit(epoch);
+    return result;
+}
+
+void handle_call_pad(int call_pad_socket, const char *message, size_t len) {
+    char response[BUFFER_SIZE];
+    if (process_call(message, len, response, sizeof(response), NULL) == 0) {
+        send_message(call_pad_socket, response);
+    }
+}
+
+int process_session_frame(const char *frame, size_t len, char *response, size_t size, struct conn *conn) {
+    uint32_t id;
+    const char *request;
+    size_t request_len;
+    if (parse_request_id(frame, len, &id, &request, &request_len) == -1) {
+        fprintf(stderr, "Error parsing session request: %.*s\n", (int)len, frame);
+        return -1;
+    }
+
+    // A bad request only fails itself, the session carries on
+    int n = snprintf(response, size, "%u ", id);
+    enum msg_type type = message_type(request, request_len);
+    int rc = -1;
+    if (type == MSG_CALL || type == MSG_CALLS) {
+        rc = process_call_at(request, request_len, response, n, size, conn);
+    }
+    if (rc == -1) {
+        snprintf(response + n, size - n, "INVALID");
+    }
+    return rc == 1;
+}
+
+// Call pad session: answer requests until the call pad hangs up
+void handle_session(int call_pad_socket, msg_buf *buf) {
+    char *message;
+    size_t len;
+    while ((message = next_msg(call_pad_socket, buf, &len)) != NULL) {
         char response[BUFFER_SIZE];
-        snprintf(response, sizeof(response), "UNAVAILABLE");
-        send(call_pad_socket, response, strlen(response), 0);
+        if (process_session_frame(message, len, response, sizeof(response), NULL) == -1 ||
+            send_message(call_pad_socket, response) == -1) {
+            return;
+        }
     }
-    pthread_mutex_unlock(&car_mutex);
+}
 
-    close(call_pad_socket);
+// Thread per accepted connection: the first frame says whether it is a car
+// or a call pad.
+void *handle_connection(void *arg) {
+    struct thread_args *args = (struct thread_args *)arg;
+    int socket = args->socket;
+    free(args);
+
+    msg_buf buf;
+    msg_buf_init(&buf);
+    size_t len;
+    // Connections that never say what they are are dropped, see handle_car()
+    // for cars
+    set_receive_timeout(socket, idle_timeout_ms);
+    char *message = next_msg(socket, &buf, &len);
+    if (message != NULL) {
+        switch (message_type(message, len)) {
+        case MSG_CAR:
+            handle_car(socket, &buf, message, len);
+            break;
+        case MSG_CALL:
+        case MSG_CALLS:
+            handle_call_pad(socket, message, len);
+            break;
+        case MSG_SESSION:
+            set_receive_timeout(socket, 0);
+            handle_session(socket, &buf);
+            break;
+        default:
+            break;
+        }
+    }
+    close(socket);
     return NULL;
 }
 
-void start_server() {
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
+// Listen on a Unix domain socket at path, replacing any stale socket file
+// left behind by a previous run.
+static int open_unix_listener(const char *path) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Unix socket path too long: %s\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd == -1) {
+        perror("socket()");
+        exit(1);
+    }
+    unlink(path);
+    if (bind(fd, (const struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        perror("bind()");
+        close(fd);
+        exit(1);
+    }
+    if (listen(fd, SOMAXCONN) == -1) {
+        perror("listen()");
+        close(fd);
+        unlink(path);
+        exit(1);
+    }
+    return fd;
+}
+
+// Thread-per-connection accept loop for one listener. Connection threads
+// need little stack, so they do not get the default 8 MB each.
+void *accept_loop(void *arg) {
+    struct listener *l = arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, CONNECTION_STACK_SIZE);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int client_socket = accept(l->fd, NULL, NULL);
+        if (client_socket == -1) {
+            perror("accept()");
+            continue;
+        }
+        conn_set_nodelay(client_socket, l->tcp);
 
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == -1) {
+        struct thread_args *args = malloc(sizeof(struct thread_args));
+        if (args == NULL) {
+            perror("malloc");
+            close(client_socket);
+            continue;
+        }
+        args->socket = client_socket;
+
+        pthread_t connection_thread;
+        if (pthread_create(&connection_thread, &attr, handle_connection, args) != 0) {
+            perror("pthread_create()");
+            close(client_socket);
+            free(args);
+        }
+    }
+    return NULL;
+}
+
+// TCP listener on PORT. With reuseport several of them can be bound at
+// once and the kernel spreads incoming connections across them.
+static int open_tcp_listener(int reuseport) {
+    struct sockaddr_in server_addr;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd == -1) {
         perror("socket()");
         exit(1);
     }
 
     int opt_enable = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1) {
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt_enable, sizeof(opt_enable)) == -1 ||
+        (reuseport && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt_enable, sizeof(opt_enable)) == -1)) {
         perror("setsockopt()");
-        close(server_socket);
+        close(fd);
         exit(1);
     }
 
@@ -305,69 +1633,73 @@ void start_server() {
     server_addr.sin_port = htons(PORT);
     server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(server_socket, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
+    if (bind(fd, (const struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
         perror("bind()");
-        close(server_socket);
+        close(fd);
         exit(1);
     }
 
-    if (listen(server_socket, 10) == -1) {
+    if (listen(fd, SOMAXCONN) == -1) {
         perror("listen()");
-        close(server_socket);
+        close(fd);
         exit(1);
     }
+    return fd;
+}
+
+void start_server() {
+    int shards = strcmp(io_mode, "shards") == 0;
+    if (io_threads < 1) {
+        io_threads = REACTOR_THREADS;
+    }
+
+    // One TCP listener per shard, or one shared by every thread. The Unix
+    // domain socket is always shared.
+    struct listener *listeners = calloc(io_threads + 1, sizeof(struct listener));
+    if (listeners == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    int listener_count = 0;
+    server_socket = open_tcp_listener(shards);
+    listeners[listener_count++] = (struct listener){ server_socket, 1, shards ? 0 : -1 };
+    for (int i = 1; shards && i < io_threads; i++) {
+        listeners[listener_count++] = (struct listener){ open_tcp_listener(1), 1, i };
+    }
+    if (unix_path != NULL) {
+        unix_socket = open_unix_listener(unix_path);
+        listeners[listener_count++] = (struct listener){ unix_socket, 0, -1 };
+    }
 
     signal(SIGINT, handle_sigint);
     signal(SIGPIPE, SIG_IGN);
 
     log_message("Controller is running");
 
-    while (1) {
-        int *client_socket = malloc(sizeof(int));
-        if (client_socket == NULL) {
-            perror("malloc");
-            exit(1);
-        }
-        *client_socket = accept(server_socket, (struct sockaddr *)&client_addr, 
-                              &client_addr_len);
-        if (*client_socket == -1) {
-            perror("accept()");
-            free(client_socket);
-            continue;
-        }
-
-        char *buffer = receive_msg(*client_socket);
+    if (strcmp(io_mode, "epoll") == 0 || shards) {
+        reactor_run(listeners, listener_count, io_threads, shards);
+        return;
+    }
+    if (strcmp(io_mode, "uring") == 0) {
+        uring_run(listeners, listener_count);
+        return;
+    }
+    if (strcmp(io_mode, "pool") == 0) {
+        pool_run(listeners, listener_count, io_threads);
+        return;
+    }
+    if (strcmp(io_mode, "coro") == 0) {
+        coro_run(listeners, listener_count, io_threads);
+        return;
+    }
 
-        if (buffer == NULL) {
-            close(*client_socket);
-            free(client_socket);
-            continue;
+    for (int i = 1; i < listener_count; i++) {
+        pthread_t accept_thread;
+        if (pthread_create(&accept_thread, NULL, accept_loop, &listeners[i]) != 0) {
+            perror("pthread_create()");
+            exit(1);
         }
-
-        if (strncmp(buffer, "CAR", 3) == 0) {
-            // Handle car connection similarly with thread_args
-            struct thread_args *args = malloc(sizeof(struct thread_args));
-            args->socket = *client_socket;
-            args->initial_message = buffer;  // Pass the buffer to the thread
-            
-            pthread_t car_thread;
-            pthread_create(&car_thread, NULL, handle_car, args);
-            pthread_detach(car_thread);
-        } 
-        else if (strncmp(buffer, "CALL", 4) == 0) {
-            // Create thread_args structure to pass both socket and message
-            struct thread_args *args = malloc(sizeof(struct thread_args));
-            args->socket = *client_socket;
-            args->initial_message = buffer;  // Pass the buffer to the thread
-            
-            pthread_t call_pad_thread;
-            pthread_create(&call_pad_thread, NULL, handle_call_pad, args);
-            pthread_detach(call_pad_thread);
-        } 
-        else {
-            close(*client_socket);
-            free(buffer);
-        }
-        free(client_socket);
-    }
-}
\ No newline at end of file
+        pthread_detach(accept_thread);
+    }
+    accept_loop(&listeners[0]);
+}
@@ -0,0 +1,68 @@
+#ifndef CONTROLLER_H
+#define CONTROLLER_H
+
+#include <stddef.h>
+#include "car_shared_mem.h"
+
+#define BUFFER_SIZE 1024
+#define PORT 3000
+
+extern int server_socket;
+
+// Deadlines from the command line in milliseconds, 0 for none. Transports
+// with an event loop keep them on its timer wheel (see timer.h), threads
+// blocked in read() on their socket's receive timeout. Both are 0 with
+// --io pool and uring, which refuse them.
+// The idle timeout only covers connections that have not sent their first
+// frame. Sessions (SESSION) stay open however long they are quiet, and a
+// call pad's single CALL is answered at once.
+extern int idle_timeout_ms;   // Connections that send nothing for this long are closed
+extern int heartbeat_ms;      // Cars are checked on after sending nothing for this long
+
+void log_message(const char *message);
+
+// Message handlers shared by the thread-per-connection server and the reactor.
+// Each takes a complete frame, which need not be NUL-terminated.
+Car *register_car(const char *message, size_t len, int socket, struct conn *conn);
+void process_status(Car *car, const char *message, size_t len);
+// process_call() also accepts a CALLS batch, answered with
+// "CARS {car name or UNAVAILABLE} ..." in request order.
+//
+// With --dispatch thread and a conn, the call pad's event loop connection,
+// the call is handed to the dispatcher thread, which sends the reply to
+// conn itself (see conn_reply()), and these return 1. Connection threads
+// pass NULL and wait for the answer in response.
+int process_call(const char *message, size_t len, char *response, size_t size, struct conn *conn);
+
+// Answer one "{id} {request}" frame of a call pad session with "{id} {reply}".
+// Replies carry the id so that a call pad can keep many requests in flight
+// and match answers in any order. Returns -1 if the frame has no id.
+int process_session_frame(const char *frame, size_t len, char *response, size_t size, struct conn *conn);
+
+// Called by the transport serving a car once its connection has closed.
+// Detaches the socket, reactor connection and shared-memory channel so
+// nothing is sent to them afterwards, and removes the car from the
+// registry. The transport must not touch the car again.
+void car_disconnected(Car *car);
+
+// Called by the transport serving a car that has sent nothing for
+// heartbeat_ms. A car that should have reported by then, because it has
+// stops to make or was last seen moving or with its doors open, gets no
+// more calls and its waiting passengers go to other cars until it reports
+// again. An idle car has nothing to report and is left alone.
+void car_silent(Car *car);
+
+// Handle a frame from a registered car, either a text STATUS or a binary
+// wire_status record (see protocol.h).
+void process_car_frame(Car *car, const char *frame, size_t len);
+
+// Send a message to a car over whichever transport it registered with.
+// Caller must hold car->mutex.
+void car_send(Car *car, const char *message);
+void car_send_frame(Car *car, const void *frame, size_t len);
+
+// Send a FLOOR command in the car's negotiated encoding and transport.
+// Caller must hold car->mutex.
+void car_send_floor(Car *car, int floor);
+
+#endif // CONTROLLER_H
@@ -0,0 +1,430 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "coro.h"
+#include "protocol.h"
+#include "reactor.h"
+
+struct loop;
+
+struct session {
+    struct conn base;          // Frame parsing and queued output, see reactor.h
+    struct loop *loop;
+    ucontext_t ctx;
+    void *stack;
+    uint32_t waiting;          // Events it is suspended on, 0 while running or runnable
+    int broken;                // The loop could not write its output
+    int done;                  // session_main() returned
+    unsigned frames;           // Frames handled, see CORO_FRAMES_PER_TURN
+    struct session *next_runnable;
+};
+
+struct loop {
+    pthread_t tid;
+    int epfd;
+    struct listener *listeners;
+    int listener_count;
+    ucontext_t ctx;            // Sessions switch back to this
+    struct session *running;
+    struct session *runnable;  // Let others run, resumed after this round of events
+    struct session **runnable_tail;
+    void *stacks[CORO_STACK_CACHE];
+    int stack_count;
+    timer_wheel timers;        // Deadlines of its sessions
+    uint64_t now_ms;           // Read once per round of events
+};
+
+static __thread struct loop *current_loop;
+
+static void *stack_get(struct loop *l) {
+    if (l->stack_count > 0) {
+        return l->stacks[--l->stack_count];
+    }
+    void *stack = mmap(NULL, CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED) {
+        perror("mmap");
+        return NULL;
+    }
+    // A session that overflows its stack faults here instead of running
+    // into whatever is mapped below it
+    if (mprotect(stack, getpagesize(), PROT_NONE) == -1) {
+        perror("mprotect");
+        munmap(stack, CORO_STACK_SIZE);
+        return NULL;
+    }
+    return stack;
+}
+
+static void stack_put(struct loop *l, void *stack) {
+    if (l->stack_count < CORO_STACK_CACHE) {
+        l->stacks[l->stack_count++] = stack;
+    } else {
+        munmap(stack, CORO_STACK_SIZE);
+    }
+}
+
+// Switch back to the loop until the socket reports one of events, or, with
+// none, until the loop gets round to the runnable sessions.
+static void suspend(struct session *s, uint32_t events) {
+    s->waiting = events;
+    swapcontext(&s->ctx, &s->loop->ctx);
+}
+
+static void yield_turn(struct session *s) {
+    struct loop *l = s->loop;
+    s->next_runnable = NULL;
+    *l->runnable_tail = s;
+    l->runnable_tail = &s->next_runnable;
+    suspend(s, 0);
+}
+
+static void session_timeout(timer *t);
+
+// Start the session's deadline again now that its peer has sent something.
+// Only cars and peers still to send their first frame have one.
+static void session_watch(struct session *s) {
+    struct conn *c = &s->base;
+    int ms = c->state == CONN_CAR ? heartbeat_ms : c->state == CONN_HELLO ? idle_timeout_ms : 0;
+    if (ms > 0) {
+        timer_start(&s->loop->timers, &c->deadline, s->loop->now_ms, ms, session_timeout);
+    } else {
+        timer_stop(&s->loop->timers, &c->deadline);
+    }
+}
+
+// The peer has sent nothing for its deadline: a car is checked on and
+// watched again. Anything else is shut down, which wakes the session to
+// find the connection closed.
+static void session_timeout(timer *t) {
+    struct session *s = (struct session *)((char *)t - offsetof(struct session, base.deadline));
+    if (s->base.state == CONN_CAR) {
+        car_silent(s->base.car);
+        session_watch(s);
+    } else {
+        shutdown(s->base.fd, SHUT_RDWR);
+    }
+}
+
+// next_msg() for a session: suspends instead of blocking. Returns NULL on
+// EOF, a read error or an oversized frame.
+static char *session_next_frame(struct session *s, size_t *len) {
+    struct conn *c = &s->base;
+    if (++s->frames % CORO_FRAMES_PER_TURN == 0) {
+        yield_turn(s);
+    }
+    while (1) {
+        char *frame;
+        int rc = msg_buf_frame(&c->in, &frame, len);
+        if (rc == 1) {
+            return frame;
+        }
+        if (rc == -1) {
+            fprintf(stderr, "Frame too large\n");
+            return NULL;
+        }
+        ssize_t received = msg_buf_fill(c->fd, &c->in);
+        if (received == 0) {
+            return NULL;
+        }
+        if (received > 0) {
+            session_watch(s);
+        } else {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                suspend(s, EPOLLIN);
+            } else if (errno != EINTR) {
+                return NULL;
+            }
+        }
+    }
+}
+
+// Wait until everything queued, and every reply the dispatcher thread owes,
+// has been written. Returns -1 if it cannot be.
+static int session_drain(struct session *s) {
+    struct conn *c = &s->base;
+    while (!s->broken) {
+        pthread_mutex_lock(&c->out_lock);
+        int drained = conn_drained_locked(c);
+        pthread_mutex_unlock(&c->out_lock);
+        if (drained) {
+            return 0;
+        }
+        suspend(s, EPOLLOUT);
+    }
+    return -1;
+}
+
+// handle_car() over the session's connection
+static void session_car(struct session *s, const char *hello, size_t len) {
+    Car *car = register_car(hello, len, s->base.fd, &s->base);
+    if (car == NULL) {
+        return;
+    }
+    s->base.car = car;
+    s->base.state = CONN_CAR;
+    session_watch(s);
+    char *frame;
+    while ((frame = session_next_frame(s, &len)) != NULL) {
+        process_car_frame(car, frame, len);
+    }
+    // Stop call pads sending to the connection once it is closed
+    car_disconnected(car);
+}
+
+// handle_session(): answer requests until the call pad hangs up
+static void session_requests(struct session *s) {
+    char *frame;
+    size_t len;
+    while ((frame = session_next_frame(s, &len)) != NULL) {
+        char response[BUFFER_SIZE];
+        int rc = process_session_frame(frame, len, response, sizeof(response), &s->base);
+        if (rc == -1) {
+            return;
+        }
+        if (rc == 0) {
+            conn_send(&s->base, response);
+        }
+    }
+}
+
+// handle_connection(): the first frame says whether it is a car or a call pad
+static void session_main(void) {
+    struct session *s = current_loop->running;
+    size_t len;
+    char *frame = session_next_frame(s, &len);
+    if (frame != NULL) {
+        switch (message_type(frame, len)) {
+        case MSG_CAR:
+            session_car(s, frame, len);
+            break;
+        case MSG_CALL:
+        case MSG_CALLS: {
+            s->base.state = CONN_CLOSING;
+            session_watch(s);
+            char response[BUFFER_SIZE];
+            if (process_call(frame, len, response, sizeof(response), &s->base) == 0) {
+                conn_send(&s->base, response);
+            }
+            break;
+        }
+        case MSG_SESSION:
+            s->base.state = CONN_SESSION;
+            session_watch(s);
+            session_requests(s);
+            break;
+        default:
+            break;
+        }
+    }
+    session_drain(s);
+    while (conn_close_deferred(&s->base)) {
+        suspend(s, EPOLLOUT);
+    }
+    s->done = 1;
+}
+
+static void session_close(struct loop *l, struct session *s) {
+    struct conn *c = &s->base;
+    timer_stop(&l->timers, &c->deadline);
+    epoll_ctl(l->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    pthread_mutex_destroy(&c->out_lock);
+    free(c->out);
+    stack_put(l, s->stack);
+    free(s);
+}
+
+static void resume(struct loop *l, struct session *s) {
+    s->waiting = 0;
+    l->running = s;
+    swapcontext(&l->ctx, &s->ctx);
+    l->running = NULL;
+    if (s->done) {
+        session_close(l, s);
+    }
+}
+
+// Write out what other threads left queued and wake the session if it
+// waits for this
+static void session_event(struct loop *l, struct session *s, uint32_t events) {
+    struct conn *c = &s->base;
+    if (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+        pthread_mutex_lock(&c->out_lock);
+        if (c->out_len > 0 && conn_flush_locked(c) == -1) {
+            s->broken = 1;
+        }
+        pthread_mutex_unlock(&c->out_lock);
+    }
+    if (s->waiting != 0 && (events & (s->waiting | EPOLLERR | EPOLLHUP | EPOLLRDHUP))) {
+        resume(l, s);
+    }
+}
+
+// Start a session for the connection and run it until it first waits, its
+// request is usually already in the socket
+static void session_open(struct loop *l, int fd, int tcp) {
+    struct session *s = calloc(1, sizeof(struct session));
+    void *stack = s != NULL ? stack_get(l) : NULL;
+    if (stack == NULL) {
+        if (s == NULL) {
+            perror("calloc");
+        }
+        free(s);
+        close(fd);
+        return;
+    }
+    s->loop = l;
+    s->stack = stack;
+    struct conn *c = &s->base;
+    c->fd = fd;
+    c->epfd = l->epfd;
+    c->state = CONN_HELLO;
+    msg_buf_init(&c->in);
+    c->flush = conn_flush_locked;
+    pthread_mutex_init(&c->out_lock, NULL);
+
+    conn_set_nodelay(fd, tcp);
+
+    getcontext(&s->ctx);
+    s->ctx.uc_stack.ss_sp = stack;
+    s->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    s->ctx.uc_link = &l->ctx;
+    makecontext(&s->ctx, session_main, 0);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = s;
+    if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        s->done = 1;
+        session_close(l, s);
+        return;
+    }
+    session_watch(s);
+    resume(l, s);
+}
+
+static void accept_all(struct loop *l, struct listener *listener) {
+    while (1) {
+        int fd = accept4(listener->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept()");
+            }
+            return;
+        }
+        session_open(l, fd, listener->tcp);
+    }
+}
+
+static struct listener *event_listener(struct loop *l, void *ptr) {
+    for (int i = 0; i < l->listener_count; i++) {
+        if (ptr == &l->listeners[i]) {
+            return &l->listeners[i];
+        }
+    }
+    return NULL;
+}
+
+static void *loop_run(void *arg) {
+    struct loop *l = arg;
+    struct epoll_event events[CORO_MAX_EVENTS];
+    current_loop = l;
+    l->now_ms = timer_now_ms();
+    timer_wheel_init(&l->timers, l->now_ms);
+
+    while (1) {
+        int timeout = l->runnable != NULL ? 0 : timer_timeout(&l->timers, l->now_ms);
+        int n = epoll_wait(l->epfd, events, CORO_MAX_EVENTS, timeout);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait()");
+            exit(1);
+        }
+        l->now_ms = timer_now_ms();
+        for (int i = 0; i < n; i++) {
+            struct listener *listener = event_listener(l, events[i].data.ptr);
+            if (listener != NULL) {
+                accept_all(l, listener);
+            } else {
+                session_event(l, events[i].data.ptr, events[i].events);
+            }
+        }
+        timer_advance(&l->timers, l->now_ms);
+
+        // Sessions that let others run go again, in the order they did
+        struct session *s = l->runnable;
+        l->runnable = NULL;
+        l->runnable_tail = &l->runnable;
+        while (s != NULL) {
+            struct session *next = s->next_runnable;
+            resume(l, s);
+            s = next;
+        }
+    }
+    return NULL;
+}
+
+void coro_run(struct listener *listeners, int count, int threads) {
+    if (threads < 1) {
+        threads = REACTOR_THREADS;
+    }
+    for (int i = 0; i < count; i++) {
+        int flags = fcntl(listeners[i].fd, F_GETFL, 0);
+        if (flags == -1 || fcntl(listeners[i].fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl()");
+            exit(1);
+        }
+    }
+
+    struct loop *loops = calloc(threads, sizeof(struct loop));
+    if (loops == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    for (int i = 0; i < threads; i++) {
+        struct loop *l = &loops[i];
+        l->listeners = listeners;
+        l->listener_count = count;
+        l->runnable_tail = &l->runnable;
+        l->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (l->epfd == -1) {
+            perror("epoll_create1()");
+            exit(1);
+        }
+        // EPOLLEXCLUSIVE wakes only one loop per incoming connection
+        for (int j = 0; j < count; j++) {
+            struct epoll_event ev;
+            ev.events = EPOLLIN | EPOLLEXCLUSIVE;
+            ev.data.ptr = &listeners[j];
+            if (epoll_ctl(l->epfd, EPOLL_CTL_ADD, listeners[j].fd, &ev) == -1) {
+                perror("epoll_ctl()");
+                exit(1);
+            }
+        }
+    }
+
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&loops[i].tid, NULL, loop_run, &loops[i]) != 0) {
+            perror("pthread_create()");
+            exit(1);
+        }
+    }
+    loop_run(&loops[0]);
+}
@@ -0,0 +1,26 @@
+#ifndef CORO_H
+#define CORO_H
+
+#define CORO_STACK_SIZE (64 * 1024) // Reserved per session, pages are only used once touched
+#define CORO_STACK_CACHE 256        // Stacks of finished sessions kept for new ones, per loop
+#define CORO_FRAMES_PER_TURN 32     // Frames a session handles before letting others run
+#define CORO_MAX_EVENTS 64          // Events drained per epoll_wait()
+
+struct listener;
+
+// Serve the listeners with --threads event loops (--io coro), running each
+// connection as a coroutine. A session is written like the threaded
+// handle_connection(): it waits for the next frame and answers it. When a
+// read would block, the coroutine switches back to its loop, which resumes
+// it once epoll reports the socket readable again. A session costs a small
+// struct and the stack pages it touches rather than a thread, and
+// switching between sessions does not go through the scheduler.
+//
+// Coroutines are ucontext ones with their own stack and never move between
+// loops. Output goes through the connection's buffer (see struct conn in
+// reactor.h) so that sending to a car never suspends whoever is sending,
+// which may hold car->mutex. Whatever the socket does not take is written
+// by the loop when epoll reports it writable. Does not return.
+void coro_run(struct listener *listeners, int count, int threads);
+
+#endif // CORO_H
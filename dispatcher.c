@@ -0,0 +1,90 @@
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include "dispatcher.h"
+
+struct slot {
+    unsigned seq;            // Position it was last published at plus one when full,
+                             // the next position it can be claimed for when empty
+    dispatch_event event;
+};
+
+static struct slot slots[DISPATCH_SLOTS];
+static _Alignas(64) unsigned tail;    // Next position to claim, advanced by producers
+static _Alignas(64) unsigned head;    // Next position to handle, dispatcher only
+static _Alignas(64) unsigned wake;    // Futex word, bumped to wake the dispatcher
+static unsigned waiting;              // 1 while the dispatcher may be asleep on wake
+static void (*handler)(const dispatch_event *events, size_t count);
+
+void dispatcher_push(const dispatch_event *event) {
+    unsigned pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+    struct slot *slot;
+    while (1) {
+        slot = &slots[pos & (DISPATCH_SLOTS - 1)];
+        int diff = (int)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&tail, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else {
+            if (diff < 0) {
+                sched_yield(); // Full, the dispatcher is DISPATCH_SLOTS events behind
+            }
+            pos = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        }
+    }
+    slot->event = *event;
+    __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting, __ATOMIC_SEQ_CST)) {
+        __atomic_add_fetch(&wake, 1, __ATOMIC_SEQ_CST);
+        syscall(SYS_futex, &wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
+
+static int ready(void) {
+    return __atomic_load_n(&slots[head & (DISPATCH_SLOTS - 1)].seq, __ATOMIC_SEQ_CST) == head + 1;
+}
+
+static void *dispatcher_loop(void *arg) {
+    (void)arg;
+    dispatch_event events[DISPATCH_MAX_EVENTS];
+    while (1) {
+        while (!ready()) {
+            // Announce the sleep, then re-check: a producer either sees
+            // waiting or its slot is visible here before we block on wake
+            __atomic_store_n(&waiting, 1, __ATOMIC_SEQ_CST);
+            unsigned seen = __atomic_load_n(&wake, __ATOMIC_SEQ_CST);
+            if (!ready()) {
+                syscall(SYS_futex, &wake, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+            }
+            __atomic_store_n(&waiting, 0, __ATOMIC_RELAXED);
+        }
+
+        size_t count = 0;
+        while (count < DISPATCH_MAX_EVENTS && ready()) {
+            struct slot *slot = &slots[head & (DISPATCH_SLOTS - 1)];
+            events[count++] = slot->event;
+            __atomic_store_n(&slot->seq, head + DISPATCH_SLOTS, __ATOMIC_RELEASE);
+            head++;
+        }
+        handler(events, count);
+    }
+    return NULL;
+}
+
+void dispatcher_start(void (*handle)(const dispatch_event *events, size_t count)) {
+    for (unsigned i = 0; i < DISPATCH_SLOTS; i++) {
+        slots[i].seq = i;
+    }
+    handler = handle;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, dispatcher_loop, NULL) != 0) {
+        perror("pthread_create()");
+        exit(1);
+    }
+    pthread_detach(tid);
+}
@@ -0,0 +1,58 @@
+#ifndef DISPATCHER_H
+#define DISPATCHER_H
+
+#include <stddef.h>
+#include "controller.h"
+
+// With --dispatch thread one thread owns every car's plan. The threads
+// serving connections only parse frames and hand what they parsed to it
+// as events, so plans are never contended and calls and STATUS updates are
+// applied in the order they were queued. It sends call pads on an event
+// loop their replies itself (see conn_reply()); only a thread per
+// connection (--io threads) waits for its answer.
+//
+// That order is only the order of each producer's pushes. A car's updates
+// stay in order, but a call queued by a call pad's thread may be applied
+// before an update the car sent earlier. So a STATUS may predate the last
+// FLOOR the car was sent. update_status() in controller.c only acts on a
+// Closed car once the car has acknowledged that FLOOR.
+//
+// Events go through a bounded multi-producer/single-consumer ring: a
+// producer claims a slot by advancing the tail with a compare-and-swap and
+// publishes it by bumping the slot's sequence number, so producers never
+// lock and never wait for each other except while the ring is full. The
+// dispatcher sleeps on a futex when the ring is empty and producers only
+// make the wake syscall when it has said it is about to sleep.
+
+#define DISPATCH_SLOTS 4096     // Power of two
+#define DISPATCH_MAX_EVENTS 64  // Events handed to the handler at once
+
+enum dispatch_event_type {
+    NEW_CALL,                   // A call pad's CALL or CALLS, see call_request
+    CAR_STATUS,                 // A parsed STATUS update
+    CAR_JOIN,                   // A car registered
+    CAR_LEAVE,                  // A car's connection closed
+    CAR_OUT_OF_SERVICE,         // EMERGENCY or INDIVIDUAL SERVICE
+    CAR_SILENT                  // Sent nothing for --heartbeat, see car_silent()
+};
+
+struct call_request;
+
+typedef struct {
+    enum dispatch_event_type type;
+    Car *car;                   // All but NEW_CALL
+    int status;                 // CAR_STATUS
+    int current_floor;
+    int destination_floor;
+    const char *reason;         // CAR_OUT_OF_SERVICE
+    struct call_request *request; // NEW_CALL, answered by the handler
+} dispatch_event;
+
+// Start the dispatcher thread. It hands handle() the events in the order
+// they were queued, up to DISPATCH_MAX_EVENTS at a time.
+void dispatcher_start(void (*handle)(const dispatch_event *events, size_t count));
+
+// Queue an event for the dispatcher. Only waits if the ring is full.
+void dispatcher_push(const dispatch_event *event);
+
+#endif // DISPATCHER_H
@@ -0,0 +1,417 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "pool.h"
+#include "reactor.h"
+
+struct pool_conn {
+    struct conn base;         // Frame parsing and queued output, see reactor.h
+    int registered;           // Added to the epoll instance
+    int out_registered;       // Added to out_epfd, under base.out_lock
+};
+
+// A connection to serve and the events it was reported with
+struct task {
+    struct pool_conn *conn;
+    uint32_t events;
+};
+
+struct worker {
+    pthread_t tid;
+    int index;
+    _Alignas(64) long top;    // Oldest task, advanced by whoever takes it
+    _Alignas(64) long bottom; // One past the newest task, owner only
+    struct task tasks[POOL_DEQUE_SIZE];
+};
+
+static struct worker *workers;
+static int worker_count;
+static int epfd;
+static int wake_fd;           // eventfd, readable while a worker is asked to steal
+static int out_epfd;          // Connections with output left by another thread
+static pthread_mutex_t out_mutex = PTHREAD_MUTEX_INITIALIZER; // Draining out_epfd
+static int idle = 0;          // Workers waiting in epoll_wait()
+static struct listener *listeners;
+static int listener_count;
+
+// Owner only. Returns -1 if the deque is full.
+static int push(struct worker *w, struct pool_conn *conn, uint32_t events) {
+    long b = __atomic_load_n(&w->bottom, __ATOMIC_RELAXED);
+    long t = __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+    if (b - t >= POOL_DEQUE_SIZE) {
+        return -1;
+    }
+    struct task *slot = &w->tasks[b & (POOL_DEQUE_SIZE - 1)];
+    __atomic_store_n(&slot->conn, conn, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->events, events, __ATOMIC_RELAXED);
+    __atomic_store_n(&w->bottom, b + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static void read_task(struct worker *w, long i, struct task *task) {
+    struct task *slot = &w->tasks[i & (POOL_DEQUE_SIZE - 1)];
+    task->conn = __atomic_load_n(&slot->conn, __ATOMIC_RELAXED);
+    task->events = __atomic_load_n(&slot->events, __ATOMIC_RELAXED);
+}
+
+// The oldest task of victim, taken by its owner or stolen by another
+// worker. Returns 0 once there is none. Losing a race retries, so an owner
+// never goes to sleep with tasks left in its queue.
+static int take(struct worker *victim, struct task *task) {
+    long t = __atomic_load_n(&victim->top, __ATOMIC_ACQUIRE);
+    while (1) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        long b = __atomic_load_n(&victim->bottom, __ATOMIC_ACQUIRE);
+        if (t >= b) {
+            return 0;
+        }
+        read_task(victim, t, task);
+        if (__atomic_compare_exchange_n(&victim->top, &t, t + 1, 0,
+                                        __ATOMIC_SEQ_CST, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+}
+
+static long queued(struct worker *w) {
+    return __atomic_load_n(&w->bottom, __ATOMIC_ACQUIRE) - __atomic_load_n(&w->top, __ATOMIC_ACQUIRE);
+}
+
+// Ask one idle worker to come and steal
+static void wake_idle(void) {
+    if (__atomic_load_n(&idle, __ATOMIC_RELAXED) == 0) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(wake_fd, &one, sizeof(one)) == -1) {
+        perror("write(eventfd)");
+    }
+}
+
+static int steal_any(struct worker *w, struct task *task) {
+    for (int i = 1; i < worker_count; i++) {
+        struct worker *victim = &workers[(w->index + i) % worker_count];
+        if (take(victim, task)) {
+            if (queued(victim) > 0) {
+                wake_idle();
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Arm fd for its next event. The connection may be running on another
+// worker as soon as this returns.
+static int arm(int fd, uint32_t events, void *ptr) {
+    struct epoll_event ev;
+    ev.events = events | EPOLLONESHOT;
+    ev.data.ptr = ptr;
+    return epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+static void pool_close(struct pool_conn *pc) {
+    struct conn *c = &pc->base;
+    if (conn_close_deferred(c)) {
+        // Armed for nothing but the hangup conn_reply() will cause
+        struct epoll_event ev;
+        ev.events = EPOLLONESHOT;
+        ev.data.ptr = pc;
+        int op = pc->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+        pc->registered = 1; // It may be running on another worker once armed
+        if (epoll_ctl(epfd, op, c->fd, &ev) == -1) {
+            perror("epoll_ctl()");
+            pc->registered = op == EPOLL_CTL_MOD;
+        }
+        return;
+    }
+    if (c->car != NULL) {
+        // Senders reach the connection through car->conn under car->mutex
+        car_disconnected(c->car);
+    }
+    pthread_mutex_lock(&c->out_lock);
+    int out_registered = pc->out_registered;
+    pthread_mutex_unlock(&c->out_lock);
+    if (out_registered) {
+        // Not while a worker may hold an event for it, see flush_out()
+        pthread_mutex_lock(&out_mutex);
+        epoll_ctl(out_epfd, EPOLL_CTL_DEL, c->fd, NULL);
+        pthread_mutex_unlock(&out_mutex);
+    }
+    if (pc->registered) {
+        epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    }
+    close(c->fd);
+    pthread_mutex_destroy(&c->out_lock);
+    free(c->out);
+    free(pc);
+}
+
+// Read and handle what has arrived, up to POOL_READS_PER_TASK reads.
+// Level-triggered, so anything left over reports the connection again.
+static int pool_read(struct conn *c) {
+    for (int reads = 0; reads < POOL_READS_PER_TASK; reads++) {
+        ssize_t received = msg_buf_fill(c->fd, &c->in);
+        if (received > 0) {
+            if (conn_parse(c) == -1) {
+                return -1;
+            }
+            if (c->state == CONN_CLOSING) {
+                msg_buf_init(&c->in); // Call pads get one request per connection
+                return 0;
+            }
+            continue;
+        }
+        if (received == 0) {
+            if (c->state == CONN_SESSION) {
+                // Call pad is done sending, close once its replies are out
+                c->state = CONN_CLOSING;
+                return 0;
+            }
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Write what is queued, then close the connection if it is done or arm it
+// for the next task. A closing connection only waits to drain.
+static void pool_finish(struct pool_conn *pc) {
+    struct conn *c = &pc->base;
+    pthread_mutex_lock(&c->out_lock);
+    int rc = conn_flush_locked(c);
+    int pending = c->out_len > 0;
+    int drained = c->state == CONN_CLOSING && conn_drained_locked(c);
+    pthread_mutex_unlock(&c->out_lock);
+    if (rc == -1 || drained) {
+        pool_close(pc);
+        return;
+    }
+
+    struct epoll_event ev;
+    ev.events = (c->state == CONN_CLOSING ? 0 : EPOLLIN | EPOLLRDHUP) |
+                (pending ? EPOLLOUT : 0) | EPOLLONESHOT;
+    ev.data.ptr = pc;
+    int op = pc->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    pc->registered = 1;
+    if (epoll_ctl(epfd, op, c->fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        pc->registered = op == EPOLL_CTL_MOD;
+        pool_close(pc);
+    }
+}
+
+// conn->flush hook. Whatever the socket does not take is watched on
+// out_epfd, as the connection's own registration may be armed for input
+// only, or already reported to a worker that would then run it twice.
+static int pool_flush(struct conn *c) {
+    struct pool_conn *pc = (struct pool_conn *)c;
+    if (conn_flush_locked(c) == -1) {
+        return -1;
+    }
+    if (c->out_len > 0) {
+        struct epoll_event ev;
+        ev.events = EPOLLOUT | EPOLLONESHOT;
+        ev.data.ptr = pc;
+        if (epoll_ctl(out_epfd, pc->out_registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+            perror("epoll_ctl()");
+            return -1;
+        }
+        pc->out_registered = 1;
+    }
+    return 0;
+}
+
+// Write to the connections out_epfd reports writable. Under out_mutex, so
+// pool_close() cannot free one between the report and the write.
+static void flush_out(void) {
+    struct epoll_event events[POOL_MAX_EVENTS];
+    pthread_mutex_lock(&out_mutex);
+    int n = epoll_wait(out_epfd, events, POOL_MAX_EVENTS, 0);
+    for (int i = 0; i < n; i++) {
+        struct conn *c = events[i].data.ptr;
+        pthread_mutex_lock(&c->out_lock);
+        if (pool_flush(c) == -1) {
+            // Its next task sees the error and closes it
+            shutdown(c->fd, SHUT_RDWR);
+        }
+        conn_wake_lingering(c);
+        pthread_mutex_unlock(&c->out_lock);
+    }
+    pthread_mutex_unlock(&out_mutex);
+}
+
+static void run_task(const struct task *task) {
+    struct pool_conn *pc = task->conn;
+    if ((task->events & EPOLLERR) ||
+        ((task->events & (EPOLLIN | EPOLLHUP | EPOLLRDHUP)) && pool_read(&pc->base) == -1)) {
+        pool_close(pc);
+        return;
+    }
+    pool_finish(pc);
+}
+
+// Accept every waiting connection. Its first task is queued here rather
+// than waiting for epoll to report the request that is usually already in
+// the socket.
+static void accept_all(struct worker *w, struct listener *l) {
+    while (1) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept()");
+            }
+            return;
+        }
+        struct pool_conn *pc = calloc(1, sizeof(struct pool_conn));
+        if (pc == NULL) {
+            perror("calloc");
+            close(fd);
+            continue;
+        }
+        struct conn *c = &pc->base;
+        c->fd = fd;
+        c->epfd = epfd;
+        c->state = CONN_HELLO;
+        msg_buf_init(&c->in);
+        c->flush = pool_flush;
+        pthread_mutex_init(&c->out_lock, NULL);
+
+        conn_set_nodelay(fd, l->tcp);
+        if (push(w, pc, EPOLLIN) == -1) {
+            pool_finish(pc);
+        }
+    }
+}
+
+// Wait for events and queue a task for each connection reported
+static void poll_events(struct worker *w) {
+    struct epoll_event events[POOL_MAX_EVENTS];
+    __atomic_add_fetch(&idle, 1, __ATOMIC_RELAXED);
+    int n = epoll_wait(epfd, events, POOL_MAX_EVENTS, -1);
+    __atomic_sub_fetch(&idle, 1, __ATOMIC_RELAXED);
+    if (n == -1) {
+        if (errno == EINTR) {
+            return;
+        }
+        perror("epoll_wait()");
+        exit(1);
+    }
+    for (int i = 0; i < n; i++) {
+        void *ptr = events[i].data.ptr;
+        if (ptr == &wake_fd) {
+            uint64_t count;
+            if (read(wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+                perror("read(eventfd)");
+            }
+            arm(wake_fd, EPOLLIN, &wake_fd);
+        } else if (ptr == &out_epfd) {
+            flush_out();
+            arm(out_epfd, EPOLLIN, &out_epfd);
+        } else if (ptr >= (void *)listeners && ptr < (void *)(listeners + listener_count)) {
+            struct listener *l = ptr;
+            accept_all(w, l);
+            arm(l->fd, EPOLLIN, l);
+        } else if (push(w, ptr, events[i].events) == -1) {
+            struct task task = { ptr, events[i].events };
+            run_task(&task);
+        }
+    }
+    if (queued(w) > 1) {
+        wake_idle();
+    }
+}
+
+static void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    struct task task;
+    while (1) {
+        if (take(w, &task) || steal_any(w, &task)) {
+            run_task(&task);
+        } else {
+            poll_events(w);
+        }
+    }
+    return NULL;
+}
+
+static void add_oneshot(int fd, void *ptr) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLONESHOT;
+    ev.data.ptr = ptr;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        exit(1);
+    }
+}
+
+void pool_run(struct listener *ls, int count, int threads) {
+    if (threads < 1) {
+        threads = REACTOR_THREADS;
+    }
+    listeners = ls;
+    listener_count = count;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epfd == -1) {
+        perror("epoll_create1()");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        int flags = fcntl(ls[i].fd, F_GETFL, 0);
+        if (flags == -1 || fcntl(ls[i].fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl()");
+            exit(1);
+        }
+        add_oneshot(ls[i].fd, &ls[i]);
+    }
+    wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+        perror("eventfd()");
+        exit(1);
+    }
+    add_oneshot(wake_fd, &wake_fd);
+    out_epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (out_epfd == -1) {
+        perror("epoll_create1()");
+        exit(1);
+    }
+    add_oneshot(out_epfd, &out_epfd);
+
+    workers = aligned_alloc(64, threads * sizeof(struct worker));
+    if (workers == NULL) {
+        perror("aligned_alloc");
+        exit(1);
+    }
+    memset(workers, 0, threads * sizeof(struct worker));
+    worker_count = threads;
+    for (int i = 0; i < threads; i++) {
+        workers[i].index = i;
+    }
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&workers[i].tid, NULL, worker_loop, &workers[i]) != 0) {
+            perror("pthread_create()");
+            exit(1);
+        }
+    }
+    worker_loop(&workers[0]);
+}
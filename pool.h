@@ -0,0 +1,32 @@
+#ifndef POOL_H
+#define POOL_H
+
+#define POOL_DEQUE_SIZE 128     // Tasks a worker holds (power of two, above POOL_MAX_EVENTS)
+#define POOL_MAX_EVENTS 64      // Events taken per epoll_wait()
+#define POOL_READS_PER_TASK 16  // Reads a task makes before its connection goes to the back
+
+struct listener;
+
+// Serve the listeners with a fixed pool of worker threads (--io pool), so
+// the number of threads no longer grows with the number of connections.
+//
+// Every connection is registered one-shot with a single epoll instance, so
+// it is armed for one event at a time and at most one task exists for it.
+// An idle worker waits on the epoll instance and turns the events it gets
+// into tasks on its own queue. Only the owner pushes, at the bottom; the
+// owner and thieves alike take the oldest task from the top with a
+// compare-and-swap. Taking the oldest first, rather than the newest as in a
+// Chase-Lev deque, starts a worker's tasks in the order their events were
+// reported. Tasks on different workers run in parallel, so that is no
+// ordering between connections: a call may be handled before a car that
+// registered just ahead of it is known. A task reads and handles the
+// connection's frames, writes its replies and arms it again. A worker that
+// queued more than one task wakes an idle one to steal, so a burst of
+// events does not hold up the tasks behind it.
+//
+// Output queued from another thread is written straight away; whatever the
+// socket does not take is watched on a second epoll instance, nested in the
+// first, and written by a worker once the socket has room. Does not return.
+void pool_run(struct listener *listeners, int count, int workers);
+
+#endif // POOL_H
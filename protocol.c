@@ -0,0 +1,242 @@
+#include <string.h>
+#include "protocol.h"
+
+// Hand-written parsers for the text protocol. Every function takes a
+// (pointer, length) view of a frame and never reads outside it, so frames
+// can be parsed in place inside a receive buffer. Tokens are separated by
+// one or more spaces and a message must not have anything after its last
+// field.
+
+typedef struct {
+    const char *pos;
+    const char *end;
+} cursor;
+
+// Point tok/len at the next space separated token. Returns 0, or -1 at the
+// end of the frame.
+static int next_token(cursor *c, const char **tok, size_t *len) {
+    while (c->pos < c->end && *c->pos == ' ') {
+        c->pos++;
+    }
+    if (c->pos == c->end) {
+        return -1;
+    }
+    const char *start = c->pos;
+    while (c->pos < c->end && *c->pos != ' ') {
+        c->pos++;
+    }
+    *tok = start;
+    *len = c->pos - start;
+    return 0;
+}
+
+static int more_tokens(cursor *c) {
+    while (c->pos < c->end && *c->pos == ' ') {
+        c->pos++;
+    }
+    return c->pos < c->end;
+}
+
+static int at_end(cursor *c) {
+    return !more_tokens(c);
+}
+
+static inline int token_is(const char *tok, size_t len, const char *word) {
+    size_t n = strlen(word);
+    return len == n && memcmp(tok, word, n) == 0;
+}
+
+static int next_floor(cursor *c, int *floor) {
+    const char *tok;
+    size_t len;
+    if (next_token(c, &tok, &len) == -1) {
+        return -1;
+    }
+    return parse_floor(tok, len, floor);
+}
+
+// Start a cursor on frame and consume the keyword. Returns -1 if the frame
+// does not begin with it.
+static int expect_keyword(cursor *c, const char *frame, size_t len, const char *keyword) {
+    const char *tok;
+    size_t tok_len;
+    c->pos = frame;
+    c->end = frame + len;
+    if (next_token(c, &tok, &tok_len) == -1 || !token_is(tok, tok_len, keyword)) {
+        return -1;
+    }
+    return 0;
+}
+
+enum msg_type message_type(const char *frame, size_t len) {
+    cursor c = { frame, frame + len };
+    const char *tok;
+    size_t tok_len;
+    if (next_token(&c, &tok, &tok_len) == -1) {
+        return MSG_UNKNOWN;
+    }
+    switch (tok[0]) {
+    case 'C':
+        if (token_is(tok, tok_len, "CAR")) return MSG_CAR;
+        if (token_is(tok, tok_len, "CALL")) return MSG_CALL;
+        if (token_is(tok, tok_len, "CALLS")) return MSG_CALLS;
+        break;
+    case 'S':
+        if (token_is(tok, tok_len, "STATUS")) return MSG_STATUS;
+        if (token_is(tok, tok_len, "SESSION")) return MSG_SESSION;
+        break;
+    case 'F':
+        if (token_is(tok, tok_len, "FLOOR")) return MSG_FLOOR;
+        break;
+    case 'E':
+        if (token_is(tok, tok_len, "EMERGENCY") && at_end(&c)) return MSG_EMERGENCY;
+        break;
+    case 'I':
+        if (token_is(tok, tok_len, "INDIVIDUAL") && next_token(&c, &tok, &tok_len) == 0 &&
+            token_is(tok, tok_len, "SERVICE") && at_end(&c)) return MSG_INDIVIDUAL_SERVICE;
+        break;
+    }
+    return MSG_UNKNOWN;
+}
+
+// Floors are B99-B1 and 1-999 with no leading zeros, so every floor has
+// exactly one spelling and string comparisons of floor names stay valid.
+int parse_floor(const char *str, size_t len, int *floor) {
+    size_t i = 0, max_digits = 3;
+    int sign = 1;
+    if (len > 0 && str[0] == 'B') {
+        sign = -1;
+        max_digits = 2;
+        i = 1;
+    }
+    if (len - i == 0 || len - i > max_digits || str[i] == '0') {
+        return -1;
+    }
+    int value = 0;
+    for (; i < len; i++) {
+        if (str[i] < '0' || str[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (str[i] - '0');
+    }
+    *floor = sign * value;
+    return 0;
+}
+
+// Returns the enum car_status for a status name, or -1.
+int parse_status_name(const char *str, size_t len) {
+    for (int i = OPENING; i <= BETWEEN; i++) {
+        if (token_is(str, len, status_names[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parse_car(const char *frame, size_t len, car_msg *msg) {
+    cursor c;
+    const char *tok;
+    size_t tok_len;
+    if (expect_keyword(&c, frame, len, "CAR") == -1 ||
+        next_token(&c, &msg->name, &msg->name_len) == -1 ||
+        msg->name_len > MAX_CAR_NAME ||
+        next_floor(&c, &msg->lowest_floor) == -1 ||
+        next_floor(&c, &msg->highest_floor) == -1 ||
+        msg->lowest_floor > msg->highest_floor) {
+        return -1;
+    }
+    msg->binary = 0;
+    msg->shm = 0;
+    while (next_token(&c, &tok, &tok_len) == 0) {
+        if (token_is(tok, tok_len, BINARY_OPTION)) {
+            msg->binary = 1;
+        } else if (token_is(tok, tok_len, SHM_OPTION)) {
+            msg->shm = 1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int parse_status(const char *frame, size_t len, status_msg *msg) {
+    cursor c;
+    const char *tok;
+    size_t tok_len;
+    if (expect_keyword(&c, frame, len, "STATUS") == -1 ||
+        next_token(&c, &tok, &tok_len) == -1 ||
+        (msg->status = parse_status_name(tok, tok_len)) == -1 ||
+        next_floor(&c, &msg->current_floor) == -1 ||
+        next_floor(&c, &msg->destination_floor) == -1) {
+        return -1;
+    }
+    return at_end(&c) ? 0 : -1;
+}
+
+int parse_call(const char *frame, size_t len, call_msg *msg) {
+    cursor c;
+    if (expect_keyword(&c, frame, len, "CALL") == -1 ||
+        next_floor(&c, &msg->source_floor) == -1 ||
+        next_floor(&c, &msg->destination_floor) == -1) {
+        return -1;
+    }
+    return at_end(&c) ? 0 : -1;
+}
+
+// At least one and at most max source/destination pairs
+int parse_call_batch(const char *frame, size_t len, call_msg *calls, size_t max, size_t *count) {
+    cursor c;
+    if (expect_keyword(&c, frame, len, "CALLS") == -1) {
+        return -1;
+    }
+    size_t n = 0;
+    while (more_tokens(&c)) {
+        if (n == max) {
+            return -1;
+        }
+        if (next_floor(&c, &calls[n].source_floor) == -1 ||
+            next_floor(&c, &calls[n].destination_floor) == -1) {
+            return -1;
+        }
+        n++;
+    }
+    if (n == 0) {
+        return -1;
+    }
+    *count = n;
+    return 0;
+}
+
+int parse_floor_cmd(const char *frame, size_t len, int *floor) {
+    cursor c;
+    if (expect_keyword(&c, frame, len, "FLOOR") == -1 ||
+        next_floor(&c, floor) == -1) {
+        return -1;
+    }
+    return at_end(&c) ? 0 : -1;
+}
+
+// Request ids are up to 9 decimal digits so they always fit in 32 bits.
+int parse_request_id(const char *frame, size_t len, uint32_t *id,
+                     const char **request, size_t *request_len) {
+    cursor c = { frame, frame + len };
+    const char *tok;
+    size_t tok_len;
+    if (next_token(&c, &tok, &tok_len) == -1 || tok_len > 9) {
+        return -1;
+    }
+    uint32_t value = 0;
+    for (size_t i = 0; i < tok_len; i++) {
+        if (tok[i] < '0' || tok[i] > '9') {
+            return -1;
+        }
+        value = value * 10 + (tok[i] - '0');
+    }
+    while (c.pos < c.end && *c.pos == ' ') {
+        c.pos++;
+    }
+    *id = value;
+    *request = c.pos;
+    *request_len = c.end - c.pos;
+    return 0;
+}
@@ -0,0 +1,148 @@
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include "car_shared_mem.h"
+#include "shm_ring.h"
+
+// Compact binary records for the car <-> controller stream.
+//
+// A car asks for them by appending BINARY_OPTION to its CAR message
+// ("CAR Alpha 1 10 BINARY"). A controller that supports them answers with a
+// BINARY_OPTION text frame, after which STATUS and FLOOR travel as the
+// fixed-size records below instead of text. Records use the same length
+// prefixed framing as text and always have WIRE_BINARY set in their first
+// byte, which no text message does. Cars that do not ask, and controllers
+// that do not answer, keep using text.
+
+#define BINARY_OPTION "BINARY"
+#define WIRE_BINARY 0x80
+
+enum wire_type {
+    WIRE_STATUS = WIRE_BINARY | 1,
+    WIRE_FLOOR = WIRE_BINARY | 2
+};
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;              // WIRE_STATUS
+    uint8_t status;            // enum car_status
+    int16_t current_floor;     // Network byte order, basements are negative
+    int16_t destination_floor; // Same format as above
+} wire_status;
+
+typedef struct __attribute__((packed)) {
+    uint8_t type;              // WIRE_FLOOR
+    uint8_t reserved;
+    int16_t floor;             // Network byte order, basements are negative
+} wire_floor;
+
+static const char *const status_names[] = {
+    [OPENING] = "Opening",
+    [OPEN] = "Open",
+    [CLOSING] = "Closing",
+    [CLOSED] = "Closed",
+    [BETWEEN] = "Between"
+};
+
+// Text messages, parsed by protocol.c. The parsers work on length-delimited
+// views (no NUL terminator needed), validate floors as they go and return
+// 0, or -1 if the message is malformed.
+
+enum msg_type {
+    MSG_UNKNOWN,
+    MSG_CAR,      // CAR {name} {lowest floor} {highest floor} [BINARY] [SHM]
+    MSG_STATUS,   // STATUS {status} {current floor} {destination floor}
+    MSG_CALL,     // CALL {source floor} {destination floor}
+    MSG_CALLS,    // CALLS {source floor} {destination floor} [...], see MAX_CALL_BATCH
+    MSG_FLOOR,    // FLOOR {floor}
+    MSG_SESSION,  // SESSION, then "{id} {request}" frames answered by "{id} {reply}"
+    MSG_EMERGENCY,          // EMERGENCY, a car leaving service until it is reset
+    MSG_INDIVIDUAL_SERVICE  // INDIVIDUAL SERVICE, a car taken over by a technician
+};
+
+#define MAX_CAR_NAME 255
+#define MAX_CALL_BATCH 64 // Calls in one CALLS message
+
+typedef struct {
+    const char *name;       // Points into the parsed frame, not terminated
+    size_t name_len;
+    int lowest_floor;
+    int highest_floor;
+    int binary;             // 1 if BINARY_OPTION was given
+    int shm;                // 1 if SHM_OPTION was given, see shm_ring.h
+} car_msg;
+
+typedef struct {
+    int status;             // enum car_status
+    int current_floor;
+    int destination_floor;
+} status_msg;
+
+typedef struct {
+    int source_floor;
+    int destination_floor;
+} call_msg;
+
+enum msg_type message_type(const char *frame, size_t len);
+int parse_floor(const char *str, size_t len, int *floor);
+int parse_status_name(const char *str, size_t len);
+int parse_car(const char *frame, size_t len, car_msg *msg);
+int parse_status(const char *frame, size_t len, status_msg *msg);
+int parse_call(const char *frame, size_t len, call_msg *msg);
+int parse_call_batch(const char *frame, size_t len, call_msg *calls, size_t max, size_t *count);
+int parse_floor_cmd(const char *frame, size_t len, int *floor);
+
+// Split a session frame into its request id and the request after it.
+int parse_request_id(const char *frame, size_t len, uint32_t *id,
+                     const char **request, size_t *request_len);
+
+static inline int is_binary_frame(const char *frame, size_t len) {
+    return len > 0 && ((uint8_t)frame[0] & WIRE_BINARY);
+}
+
+static inline const char *status_name(int status) {
+    if (status < OPENING || status > BETWEEN) {
+        return NULL;
+    }
+    return status_names[status];
+}
+
+// Returns the enum car_status for a status string, or -1.
+static inline int status_from_name(const char *name) {
+    for (int i = OPENING; i <= BETWEEN; i++) {
+        if (strcmp(name, status_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// "B12" -> -12, "12" -> 12
+static inline int floor_from_name(const char *name) {
+    if (name[0] == 'B') {
+        return -atoi(name + 1);
+    }
+    return atoi(name);
+}
+
+static inline void floor_name(int floor, char *buf, size_t size) {
+    if (floor < 0) {
+        snprintf(buf, size, "B%d", -floor);
+    } else {
+        snprintf(buf, size, "%d", floor);
+    }
+}
+
+static inline int16_t wire_floor_encode(int floor) {
+    return (int16_t)htons((uint16_t)(int16_t)floor);
+}
+
+static inline int wire_floor_decode(int16_t floor) {
+    return (int16_t)ntohs((uint16_t)floor);
+}
+
+#endif // PROTOCOL_H
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "queue.h"
+
+static QueueItem *slot(Queue *queue, size_t i) {
+    return &queue->items[(queue->head + i) & (queue->capacity - 1)];
+}
+
+void queue_init(Queue *queue) {
+    queue->items = NULL;
+    queue->head = 0;
+    queue->size = 0;
+    queue->capacity = 0;
+}
+
+void queue_free(Queue *queue) {
+    free(queue->items);
+    queue_init(queue);
+}
+
+// Double the ring, unwrapping it so that the next stop is at index 0
+static int queue_grow(Queue *queue) {
+    size_t capacity = queue->capacity > 0 ? queue->capacity * 2 : QUEUE_INITIAL_CAPACITY;
+    QueueItem *items = malloc(capacity * sizeof(QueueItem));
+    if (items == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < queue->size; i++) {
+        items[i] = *slot(queue, i);
+    }
+    free(queue->items);
+    queue->items = items;
+    queue->head = 0;
+    queue->capacity = capacity;
+    return 0;
+}
+
+int queue_copy(Queue *dst, const Queue *src) {
+    queue_init(dst);
+    if (src->size == 0) {
+        return 0;
+    }
+    dst->items = malloc(src->capacity * sizeof(QueueItem));
+    if (dst->items == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    for (size_t i = 0; i < src->size; i++) {
+        dst->items[i] = *queue_at(src, i);
+    }
+    dst->size = src->size;
+    dst->capacity = src->capacity;
+    return 0;
+}
+
+int queue_insert(Queue *queue, int floor, Direction dir, int sweep) {
+    if (queue->size > 0) {
+        sweep += queue_front(queue)->sweep;
+    }
+
+    // Find the first stop the new one comes before
+    size_t low = 0, high = queue->size;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        if (queue_item_before(slot(queue, mid), floor, dir, sweep)) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < queue->size && slot(queue, low)->sweep == sweep && slot(queue, low)->floor == floor) {
+        return 0;
+    }
+
+    if (queue->size == queue->capacity && queue_grow(queue) == -1) {
+        return -1;
+    }
+
+    // Open a gap at low by moving whichever side of it is shorter, with a
+    // single memmove() unless that side wraps around the end of the ring
+    if (low < queue->size / 2) {
+        queue->head = (queue->head - 1) & (queue->capacity - 1);
+        if (queue->head + low < queue->capacity) {
+            memmove(&queue->items[queue->head], &queue->items[queue->head + 1], low * sizeof(QueueItem));
+        } else {
+            for (size_t i = 0; i < low; i++) {
+                *slot(queue, i) = *slot(queue, i + 1);
+            }
+        }
+    } else {
+        size_t start = (queue->head + low) & (queue->capacity - 1);
+        size_t count = queue->size - low;
+        if (start + count < queue->capacity) {
+            memmove(&queue->items[start + 1], &queue->items[start], count * sizeof(QueueItem));
+        } else {
+            for (size_t i = queue->size; i > low; i--) {
+                *slot(queue, i) = *slot(queue, i - 1);
+            }
+        }
+    }
+    *slot(queue, low) = (QueueItem){ floor, dir, sweep };
+    queue->size++;
+    return 0;
+}
+
+void queue_pop(Queue *queue) {
+    if (queue->size > 0) {
+        queue->head = (queue->head + 1) & (queue->capacity - 1);
+        queue->size--;
+    }
+}
@@ -0,0 +1,76 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+
+// A car's planned stops, see addCallToQueue() in controller.c.
+//
+// The plan is a series of sweeps in alternating directions, LOOK style:
+// sweep 0 is the one the car is on, sweep 1 starts where it turns around,
+// and so on. Within a sweep stops are sorted in the sweep's direction and
+// each floor appears once.
+//
+// Stops are kept in visiting order in a ring that doubles when it fills,
+// so popping the next stop is O(1), an insertion finds its place with a
+// binary search and moves whichever side of it is shorter, and no stop is
+// ever dropped for lack of room.
+
+#define QUEUE_INITIAL_CAPACITY 16 // Power of two
+
+typedef enum { UP, DOWN, NONE } Direction;
+
+typedef struct {
+    int floor;
+    Direction dir;   // Direction of the stop's sweep
+    int sweep;       // Counts up for the whole life of the queue
+} QueueItem;
+
+typedef struct {
+    QueueItem *items;
+    size_t head;     // Index of the next stop
+    size_t size;
+    size_t capacity; // Power of two, 0 until the first insertion
+} Queue;
+
+void queue_init(Queue *queue);
+void queue_free(Queue *queue);
+
+// Add a stop to a sweep, counted from the current one. A floor already
+// planned on that sweep is not added twice. Returns -1 only if the queue
+// needed to grow and could not.
+int queue_insert(Queue *queue, int floor, Direction dir, int sweep);
+
+// Drop the next stop.
+void queue_pop(Queue *queue);
+
+// Make dst, which must not hold a plan, a copy of src. Returns -1 if it
+// could not be allocated.
+int queue_copy(Queue *dst, const Queue *src);
+
+// The next stop, or NULL if none are planned.
+static inline const QueueItem *queue_front(const Queue *queue) {
+    return queue->size > 0 ? &queue->items[queue->head] : NULL;
+}
+
+// The i'th stop in visiting order, i < size.
+static inline const QueueItem *queue_at(const Queue *queue, size_t i) {
+    return &queue->items[(queue->head + i) & (queue->capacity - 1)];
+}
+
+// 1 if item is visited before a stop at floor on the given sweep, both
+// counted for the whole life of the queue.
+static inline int queue_item_before(const QueueItem *item, int floor, Direction dir, int sweep) {
+    if (item->sweep != sweep) {
+        return item->sweep < sweep;
+    }
+    return dir == UP ? item->floor < floor : item->floor > floor;
+}
+
+// 1 if the i'th stop is visited before a stop at floor on a sweep counted
+// from the current one, i < size. A floor already planned on that sweep is
+// not visited before itself.
+static inline int queue_before(const Queue *queue, size_t i, int floor, Direction dir, int sweep) {
+    return queue_item_before(queue_at(queue, i), floor, dir, sweep + queue_front(queue)->sweep);
+}
+
+#endif // QUEUE_H
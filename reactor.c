@@ -0,0 +1,596 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "protocol.h"
+#include "reactor.h"
+
+// Work handed to another shard by reactor_post()
+struct shard_msg {
+    void (*fn)(Car *car, int a, int b);
+    Car *car;
+    int a;
+    int b;
+    struct shard_msg *next;
+};
+
+struct reactor_thread {
+    pthread_t tid;
+    int index;
+    int epfd;
+    struct listener *listeners;
+    int listener_count;
+    struct conn *dirty[REACTOR_MAX_DIRTY]; // Output to write after this batch
+    int dirty_count;
+    int wake_fd;                           // eventfd, readable when mailbox is not empty
+    struct shard_msg *mailbox;             // Pushed by any thread, newest first
+    timer_wheel timers;                    // Deadlines of its connections
+    uint64_t now_ms;                       // Read once per batch of events
+};
+
+static __thread struct reactor_thread *current_thread;
+static struct reactor_thread *pool;
+static int pool_size;
+static int sharded;
+
+static void conn_undirty(struct conn *c) {
+    struct reactor_thread *t = current_thread;
+    for (int i = 0; i < t->dirty_count; i++) {
+        if (t->dirty[i] == c) {
+            t->dirty[i] = NULL;
+        }
+    }
+    c->dirty = 0;
+}
+
+// Only called from the thread that owns the connection.
+static void conn_close(struct conn *c) {
+    if (conn_close_deferred(c)) {
+        return;
+    }
+    if (c->dirty) {
+        conn_undirty(c);
+    }
+    timer_stop(&current_thread->timers, &c->deadline);
+    if (c->car != NULL) {
+        // Senders reach the connection through car->conn under car->mutex
+        car_disconnected(c->car);
+    }
+    epoll_ctl(c->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    pthread_mutex_destroy(&c->out_lock);
+    free(c->out);
+    free(c);
+}
+
+int conn_flush_locked(struct conn *c) {
+    size_t written = 0;
+    while (written < c->out_len) {
+        ssize_t sent = send(c->fd, c->out + written, c->out_len - written, MSG_NOSIGNAL);
+        if (sent == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break; // EPOLLOUT will fire once there is room again
+            }
+            return -1;
+        }
+        written += sent;
+    }
+    memmove(c->out, c->out + written, c->out_len - written);
+    c->out_len -= written;
+    return 0;
+}
+
+static int conn_flush(struct conn *c) {
+    pthread_mutex_lock(&c->out_lock);
+    int rc = conn_flush_locked(c);
+    pthread_mutex_unlock(&c->out_lock);
+    return rc;
+}
+
+// conn->flush hook. Frames queued by the connection's own thread wait for
+// the end of the batch so several go out in one send(); anything queued
+// from another thread, or more than CONN_FLUSH_BYTES, is written now.
+static int conn_flush_deferred(struct conn *c) {
+    struct reactor_thread *t = current_thread;
+    if (t == NULL || t->epfd != c->epfd || c->out_len >= CONN_FLUSH_BYTES) {
+        return conn_flush_locked(c);
+    }
+    if (!c->dirty) {
+        if (t->dirty_count == REACTOR_MAX_DIRTY) {
+            return conn_flush_locked(c);
+        }
+        c->dirty = 1;
+        t->dirty[t->dirty_count++] = c;
+    }
+    return 0;
+}
+
+int conn_drained_locked(struct conn *c) {
+    if (c->owed > 0) {
+        c->lingering = 1;
+        return 0;
+    }
+    return c->out_len == 0;
+}
+
+static int conn_drained(struct conn *c) {
+    pthread_mutex_lock(&c->out_lock);
+    int drained = conn_drained_locked(c);
+    pthread_mutex_unlock(&c->out_lock);
+    return drained;
+}
+
+int conn_close_deferred(struct conn *c) {
+    pthread_mutex_lock(&c->out_lock);
+    int deferred = c->owed > 0;
+    if (deferred) {
+        c->lingering = 1;
+    }
+    pthread_mutex_unlock(&c->out_lock);
+    return deferred;
+}
+
+void conn_wake_lingering(struct conn *c) {
+    if (c->lingering && c->owed == 0 && c->out_len == 0) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+void conn_expect_reply(struct conn *c) {
+    pthread_mutex_lock(&c->out_lock);
+    c->owed++;
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+static void conn_queue_locked(struct conn *c, const void *frame, size_t len);
+
+void conn_reply(struct conn *c, const char *message) {
+    // All under out_lock: the owner may free the connection as soon as it
+    // sees nothing owed and nothing left to send
+    pthread_mutex_lock(&c->out_lock);
+    c->owed--;
+    if (message != NULL) {
+        conn_queue_locked(c, message, strlen(message));
+    } else {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    conn_wake_lingering(c);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+void conn_set_nodelay(int fd, int tcp) {
+    if (tcp) {
+        int opt_enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+    }
+}
+
+void conn_send(struct conn *c, const char *message) {
+    conn_send_frame(c, message, strlen(message));
+}
+
+void conn_send_frame(struct conn *c, const void *frame, size_t len) {
+    pthread_mutex_lock(&c->out_lock);
+    conn_queue_locked(c, frame, len);
+    pthread_mutex_unlock(&c->out_lock);
+}
+
+static void conn_queue_locked(struct conn *c, const void *frame, size_t len) {
+    uint32_t nlen = htonl(len);
+
+    if (c->out_len + sizeof(nlen) + len > CONN_OUT_MAX) {
+        // Peer is not reading; shutting down makes its owner thread see
+        // the error and close the connection.
+        shutdown(c->fd, SHUT_RDWR);
+        return;
+    }
+    if (c->out_len + sizeof(nlen) + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap : 256;
+        while (cap < c->out_len + sizeof(nlen) + len) {
+            cap *= 2;
+        }
+        char *out = realloc(c->out, cap);
+        if (out == NULL) {
+            perror("realloc");
+            shutdown(c->fd, SHUT_RDWR);
+            return;
+        }
+        c->out = out;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, &nlen, sizeof(nlen));
+    memcpy(c->out + c->out_len + sizeof(nlen), frame, len);
+    c->out_len += sizeof(nlen) + len;
+    if (c->flush(c) == -1) {
+        shutdown(c->fd, SHUT_RDWR);
+    }
+}
+
+// Handle one complete frame. Returns -1 to drop the connection.
+static int conn_handle_frame(struct conn *c, const char *frame, size_t len) {
+    switch (c->state) {
+    case CONN_HELLO:
+        switch (message_type(frame, len)) {
+        case MSG_CAR:
+            c->car = register_car(frame, len, c->fd, c);
+            if (c->car == NULL) {
+                return -1;
+            }
+            if (sharded) {
+                __atomic_store_n(&c->car->shard, current_thread->index, __ATOMIC_RELAXED);
+            }
+            c->state = CONN_CAR;
+            return 0;
+        case MSG_CALL:
+        case MSG_CALLS: {
+            char response[BUFFER_SIZE];
+            int rc = process_call(frame, len, response, sizeof(response), c);
+            if (rc == -1) {
+                return -1;
+            }
+            if (rc == 0) {
+                conn_send(c, response);
+            }
+            c->state = CONN_CLOSING;
+            return 0;
+        }
+        case MSG_SESSION:
+            c->state = CONN_SESSION;
+            return 0;
+        default:
+            return -1;
+        }
+    case CONN_CAR:
+        process_car_frame(c->car, frame, len);
+        return 0;
+    case CONN_SESSION: {
+        char response[BUFFER_SIZE];
+        int rc = process_session_frame(frame, len, response, sizeof(response), c);
+        if (rc == -1) {
+            return -1;
+        }
+        if (rc == 0) {
+            conn_send(c, response);
+        }
+        return 0;
+    }
+    case CONN_CLOSING:
+        return 0;
+    }
+    return -1;
+}
+
+int conn_parse(struct conn *c) {
+    char *frame;
+    size_t len;
+    int rc;
+    while ((rc = msg_buf_frame(&c->in, &frame, &len)) == 1) {
+        if (conn_handle_frame(c, frame, len) == -1) {
+            return -1;
+        }
+    }
+    if (rc == -1) {
+        fprintf(stderr, "Frame too large\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void conn_timeout(timer *t);
+
+// Start the connection's deadline again now that it has sent something.
+// Only cars and connections still to send their first frame have one.
+static void conn_watch(struct conn *c) {
+    struct reactor_thread *t = current_thread;
+    int ms = c->state == CONN_CAR ? heartbeat_ms : c->state == CONN_HELLO ? idle_timeout_ms : 0;
+    if (ms > 0) {
+        timer_start(&t->timers, &c->deadline, t->now_ms, ms, conn_timeout);
+    } else {
+        timer_stop(&t->timers, &c->deadline);
+    }
+}
+
+// The connection has sent nothing for its deadline: a car is checked on and
+// watched again, anything else is dropped.
+static void conn_timeout(timer *t) {
+    struct conn *c = (struct conn *)((char *)t - offsetof(struct conn, deadline));
+    if (c->state == CONN_CAR) {
+        car_silent(c->car);
+        conn_watch(c);
+    } else {
+        conn_close(c);
+    }
+}
+
+// Edge-triggered: keep reading until the socket would block.
+static int conn_read(struct conn *c) {
+    while (1) {
+        ssize_t received = msg_buf_fill(c->fd, &c->in);
+        if (received > 0) {
+            if (conn_parse(c) == -1) {
+                return -1;
+            }
+            conn_watch(c);
+            if (c->state == CONN_CLOSING) {
+                msg_buf_init(&c->in); // Call pads get one request per connection
+            }
+            continue;
+        }
+        if (received == 0) {
+            if (c->state == CONN_SESSION) {
+                // Call pad is done sending, close once its replies are out
+                c->state = CONN_CLOSING;
+                return 0;
+            }
+            return -1;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        return -1;
+    }
+}
+
+static void conn_event(struct conn *c, uint32_t events) {
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        conn_close(c);
+        return;
+    }
+    if ((events & EPOLLOUT) && conn_flush(c) == -1) {
+        conn_close(c);
+        return;
+    }
+    if ((events & EPOLLIN) && conn_read(c) == -1) {
+        conn_close(c);
+        return;
+    }
+    if (c->state == CONN_CLOSING && conn_drained(c)) {
+        conn_close(c);
+    }
+}
+
+static void conn_open(int epfd, int fd, int tcp) {
+    struct conn *c = calloc(1, sizeof(struct conn));
+    if (c == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    c->epfd = epfd;
+    c->state = CONN_HELLO;
+    msg_buf_init(&c->in);
+    c->flush = conn_flush_deferred;
+    pthread_mutex_init(&c->out_lock, NULL);
+
+    conn_set_nodelay(fd, tcp);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = c;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        perror("epoll_ctl()");
+        pthread_mutex_destroy(&c->out_lock);
+        close(fd);
+        free(c);
+        return;
+    }
+    conn_watch(c);
+}
+
+static void accept_all(struct reactor_thread *t, struct listener *l) {
+    while (1) {
+        int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                perror("accept()");
+            }
+            return;
+        }
+        conn_open(t->epfd, fd, l->tcp);
+    }
+}
+
+// Write out everything coalesced while handling the last batch of events.
+static void flush_dirty(struct reactor_thread *t) {
+    for (int i = 0; i < t->dirty_count; i++) {
+        struct conn *c = t->dirty[i];
+        if (c == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&c->out_lock);
+        c->dirty = 0;
+        int rc = conn_flush_locked(c);
+        int drained = c->state == CONN_CLOSING && conn_drained_locked(c);
+        pthread_mutex_unlock(&c->out_lock);
+        if (rc == -1 || drained) {
+            conn_close(c);
+        }
+    }
+    t->dirty_count = 0;
+}
+
+int reactor_post(int shard, void (*fn)(Car *car, int a, int b), Car *car, int a, int b) {
+    if (!sharded || shard < 0 || shard >= pool_size ||
+        (current_thread != NULL && current_thread->index == shard)) {
+        return -1;
+    }
+    struct shard_msg *msg = malloc(sizeof(struct shard_msg));
+    if (msg == NULL) {
+        perror("malloc");
+        return -1;
+    }
+    msg->fn = fn;
+    msg->car = car;
+    msg->a = a;
+    msg->b = b;
+
+    // Only the post that finds the mailbox empty needs to wake the shard
+    struct reactor_thread *t = &pool[shard];
+    msg->next = __atomic_load_n(&t->mailbox, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&t->mailbox, &msg->next, msg, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+    }
+    if (msg->next == NULL) {
+        uint64_t one = 1;
+        if (write(t->wake_fd, &one, sizeof(one)) == -1) {
+            perror("write(eventfd)");
+        }
+    }
+    return 0;
+}
+
+// Run everything posted to this shard, oldest first.
+static void drain_mailbox(struct reactor_thread *t) {
+    uint64_t count;
+    if (read(t->wake_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+        perror("read(eventfd)");
+    }
+    struct shard_msg *msg = __atomic_exchange_n(&t->mailbox, NULL, __ATOMIC_ACQUIRE);
+    struct shard_msg *fifo = NULL;
+    while (msg != NULL) {
+        struct shard_msg *next = msg->next;
+        msg->next = fifo;
+        fifo = msg;
+        msg = next;
+    }
+    while (fifo != NULL) {
+        struct shard_msg *next = fifo->next;
+        fifo->fn(fifo->car, fifo->a, fifo->b);
+        free(fifo);
+        fifo = next;
+    }
+}
+
+// Listener events carry a pointer into t->listeners, the mailbox event a
+// pointer to t->wake_fd, everything else a conn.
+static struct listener *event_listener(struct reactor_thread *t, void *ptr) {
+    for (int i = 0; i < t->listener_count; i++) {
+        if (ptr == &t->listeners[i]) {
+            return &t->listeners[i];
+        }
+    }
+    return NULL;
+}
+
+static void *reactor_loop(void *arg) {
+    struct reactor_thread *t = arg;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+    current_thread = t;
+
+    t->now_ms = timer_now_ms();
+    timer_wheel_init(&t->timers, t->now_ms);
+
+    while (1) {
+        // Sleep no longer than the wheel's next tick with something to do
+        int n = epoll_wait(t->epfd, events, REACTOR_MAX_EVENTS, timer_timeout(&t->timers, t->now_ms));
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("epoll_wait()");
+            exit(1);
+        }
+        t->now_ms = timer_now_ms();
+        for (int i = 0; i < n; i++) {
+            struct listener *l = event_listener(t, events[i].data.ptr);
+            if (events[i].data.ptr == &t->wake_fd) {
+                drain_mailbox(t);
+            } else if (l != NULL) {
+                accept_all(t, l);
+            } else {
+                conn_event(events[i].data.ptr, events[i].events);
+            }
+        }
+        timer_advance(&t->timers, t->now_ms);
+        flush_dirty(t);
+    }
+    return NULL;
+}
+
+void reactor_run(struct listener *listeners, int count, int threads, int shard_cars) {
+    if (threads < 1) {
+        threads = REACTOR_THREADS;
+    }
+    sharded = shard_cars;
+
+    for (int i = 0; i < count; i++) {
+        int flags = fcntl(listeners[i].fd, F_GETFL, 0);
+        if (flags == -1 || fcntl(listeners[i].fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            perror("fcntl()");
+            exit(1);
+        }
+    }
+
+    pool = calloc(threads, sizeof(struct reactor_thread));
+    if (pool == NULL) {
+        perror("calloc");
+        exit(1);
+    }
+    pool_size = threads;
+
+    for (int i = 0; i < threads; i++) {
+        pool[i].index = i;
+        pool[i].listeners = listeners;
+        pool[i].listener_count = count;
+        pool[i].epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (pool[i].epfd == -1) {
+            perror("epoll_create1()");
+            exit(1);
+        }
+        // Every thread watches the shared listeners; EPOLLEXCLUSIVE wakes
+        // only one of them per incoming connection. A listener bound to a
+        // shard (SO_REUSEPORT) is only watched by that shard.
+        for (int j = 0; j < count; j++) {
+            if (listeners[j].shard != -1 && listeners[j].shard != i) {
+                continue;
+            }
+            struct epoll_event ev;
+            ev.events = listeners[j].shard == -1 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+            ev.data.ptr = &listeners[j];
+            if (epoll_ctl(pool[i].epfd, EPOLL_CTL_ADD, listeners[j].fd, &ev) == -1) {
+                perror("epoll_ctl()");
+                exit(1);
+            }
+        }
+
+        pool[i].wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (pool[i].wake_fd == -1) {
+            perror("eventfd()");
+            exit(1);
+        }
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = &pool[i].wake_fd;
+        if (epoll_ctl(pool[i].epfd, EPOLL_CTL_ADD, pool[i].wake_fd, &ev) == -1) {
+            perror("epoll_ctl()");
+            exit(1);
+        }
+    }
+
+    for (int i = 1; i < threads; i++) {
+        if (pthread_create(&pool[i].tid, NULL, reactor_loop, &pool[i]) != 0) {
+            perror("pthread_create()");
+            exit(1);
+        }
+    }
+    reactor_loop(&pool[0]);
+}
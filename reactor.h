@@ -0,0 +1,104 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include "controller.h"
+#include "timer.h"
+
+#define REACTOR_THREADS 2          // Default number of event loop threads
+#define REACTOR_MAX_EVENTS 64      // Events drained per epoll_wait()
+#define CONN_OUT_MAX (64 * 1024)   // Peers that stop reading are dropped past this
+#define CONN_FLUSH_BYTES 4096      // Coalesced output is written early past this
+#define REACTOR_MAX_DIRTY 256      // Connections with deferred output per loop iteration
+
+// A listening socket served by a backend. Accepted TCP connections get
+// TCP_NODELAY, Unix domain ones have no Nagle to turn off.
+struct listener {
+    int fd;
+    int tcp;
+    int shard;  // Only this reactor thread accepts from it, -1 for every thread
+};
+
+enum conn_state {
+    CONN_HELLO,   // Waiting for the first frame (CAR or CALL)
+    CONN_CAR,     // Registered car streaming STATUS updates
+    CONN_SESSION, // Call pad session, pipelined requests until it hangs up
+    CONN_CLOSING  // Reply queued, close once the output buffer drains
+};
+
+// Per-connection state owned by the reactor thread that accepted it.
+// Output may be queued from any thread (e.g. a call pad dispatching a car
+// owned by another reactor thread), so it is guarded by out_lock. Frames
+// queued by the owning thread are coalesced and written once at the end of
+// its current batch of events.
+struct conn {
+    int fd;
+    int epfd;
+    enum conn_state state;
+    Car *car;
+    msg_buf in;                    // Received bytes, frames are parsed in place
+    pthread_mutex_t out_lock;
+    char *out;
+    size_t out_len;
+    size_t out_cap;
+    int dirty;                     // Waiting in the owner's deferred flush list
+    int owed;                      // Replies the dispatcher thread still sends, see conn_reply()
+    int lingering;                 // The owner only waits for those to close it
+    timer deadline;                // idle_timeout_ms or heartbeat_ms on the owner's wheel
+    int (*flush)(struct conn *c); // Backend hook, called with out_lock held
+};
+
+// Serve the listeners with a fixed set of edge-triggered epoll threads.
+// Does not return.
+//
+// With shard_cars set, each thread is a shard that owns the cars registered
+// on its connections (car->shard). Other shards never touch those cars
+// directly; they hand work over with reactor_post(), which is delivered
+// through a per-shard mailbox and eventfd.
+void reactor_run(struct listener *listeners, int count, int threads, int shard_cars);
+
+// Run fn(car, a, b) on the reactor thread that owns shard. Returns -1
+// without running it if sharding is off or the caller is that thread, in
+// which case the caller should run it itself.
+int reactor_post(int shard, void (*fn)(Car *car, int a, int b), Car *car, int a, int b);
+
+// Turn Nagle off on an accepted connection if it is TCP: replies are small
+// and latency sensitive.
+void conn_set_nodelay(int fd, int tcp);
+
+// Queue a framed message on the connection and try to write it out.
+void conn_send(struct conn *c, const char *message);
+void conn_send_frame(struct conn *c, const void *frame, size_t len);
+
+// Write as much queued output as the socket accepts, keeping the rest.
+// Caller holds out_lock. Returns -1 if the connection is broken.
+int conn_flush_locked(struct conn *c);
+
+// With --dispatch thread the dispatcher thread sends call pads on an event
+// loop their replies itself, so the loop never waits for it. The owner
+// counts each one with conn_expect_reply() before handing the request over
+// and does not close the connection while any is owed.
+void conn_expect_reply(struct conn *c);
+
+// Dispatcher thread: queue an owed reply, or drop the connection if message
+// is NULL. The connection must not be touched after this returns.
+void conn_reply(struct conn *c, const char *message);
+
+// Caller holds out_lock. Whether a closing connection has sent everything,
+// owed replies included.
+int conn_drained_locked(struct conn *c);
+
+// Whether the owner must put off closing the connection for owed replies.
+// Once they are out its socket is shut down, so the owner hears of it again.
+int conn_close_deferred(struct conn *c);
+
+// Caller holds out_lock. That shutdown, for a connection whose owner put
+// off closing it and that has nothing left to send.
+void conn_wake_lingering(struct conn *c);
+
+// Handle every complete frame in c->in and keep any partial tail.
+// Returns -1 if the connection should be dropped.
+int conn_parse(struct conn *c);
+
+#endif // REACTOR_H
@@ -0,0 +1,257 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "registry.h"
+
+typedef struct {
+    size_t count;    // Slots in use or emptied, published with a release store
+    size_t capacity;
+    Car *cars[];
+} car_list;
+
+// Something taken out of view that a reader may still hold
+struct retired {
+    void *ptr;
+    void (*release)(Car *car); // NULL for a car_list
+    struct retired *next;
+};
+
+static pthread_mutex_t registry_mutex = PTHREAD_MUTEX_INITIALIZER;
+static car_list *list = NULL;        // Read without registry_mutex
+static unsigned epoch = 0;           // Changed under registry_mutex, read without it
+static unsigned readers[2];          // In registry_enter() epochs, by parity
+static struct retired *retired_before = NULL; // Before the epoch changed, waits for its readers
+static struct retired *retired_since = NULL;  // Since the epoch changed
+static int have_retired = 0;         // Either list is not empty, read without registry_mutex
+
+// Emptied slots in the list, reused by the next registrations
+static size_t *free_slots = NULL;
+static size_t free_count = 0;        // The array has room for the list's capacity
+
+// Name index
+static Car **index_slots = NULL;
+static size_t index_capacity = 0;    // Power of two
+static size_t index_count = 0;
+
+static size_t name_hash(const char *name, size_t name_len) {
+    size_t hash = 14695981039346656037UL; // FNV-1a
+    for (size_t i = 0; i < name_len; i++) {
+        hash = (hash ^ (unsigned char)name[i]) * 1099511628211UL;
+    }
+    return hash;
+}
+
+static int same_name(const Car *car, const char *name, size_t name_len) {
+    return strncmp(car->name, name, name_len) == 0 && car->name[name_len] == '\0';
+}
+
+// Index slot holding the car with this name, or the empty one where it
+// would go. The index must have room.
+// Caller must hold registry_mutex
+static size_t index_slot(const char *name, size_t name_len) {
+    size_t mask = index_capacity - 1;
+    size_t i = name_hash(name, name_len) & mask;
+    while (index_slots[i] != NULL && !same_name(index_slots[i], name, name_len)) {
+        i = (i + 1) & mask;
+    }
+    return i;
+}
+
+// Keep the index at most half full
+// Caller must hold registry_mutex
+static int index_grow(void) {
+    if (2 * (index_count + 1) <= index_capacity) {
+        return 0;
+    }
+    size_t capacity = index_capacity > 0 ? index_capacity * 2 : REGISTRY_INITIAL_CAPACITY;
+    Car **slots = calloc(capacity, sizeof(Car *));
+    if (slots == NULL) {
+        perror("calloc");
+        return -1;
+    }
+    Car **old = index_slots;
+    size_t old_capacity = index_capacity;
+    index_slots = slots;
+    index_capacity = capacity;
+    for (size_t i = 0; i < old_capacity; i++) {
+        if (old[i] != NULL) {
+            index_slots[index_slot(old[i]->name, strlen(old[i]->name))] = old[i];
+        }
+    }
+    free(old);
+    return 0;
+}
+
+// Empty index slot i, moving back any car further along its probe run that
+// would no longer be found past the gap
+// Caller must hold registry_mutex
+static void index_delete(size_t i) {
+    size_t mask = index_capacity - 1;
+    index_slots[i] = NULL;
+    index_count--;
+    for (size_t j = (i + 1) & mask; index_slots[j] != NULL; j = (j + 1) & mask) {
+        size_t home = name_hash(index_slots[j]->name, strlen(index_slots[j]->name)) & mask;
+        // Move it unless its home is in the cyclic range (i, j]
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            index_slots[i] = index_slots[j];
+            index_slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+static void free_retired(struct retired *r) {
+    while (r != NULL) {
+        struct retired *next = r->next;
+        if (r->release != NULL) {
+            r->release(r->ptr);
+        } else {
+            free(r->ptr);
+        }
+        free(r);
+        r = next;
+    }
+}
+
+// Free what was retired before the epoch last changed once the old epoch
+// has no readers, then start a new epoch for what has been retired since.
+// A reader that saw a retired car or list entered before it was taken out
+// of view, so it is counted in the epoch that was current then, or it has
+// left: registry_enter() only counts a reader in an epoch that was still
+// current after it was counted, and an epoch only changes once the one
+// before it has drained.
+// Caller must hold registry_mutex
+static void reclaim(void) {
+    for (int pass = 0; pass < 2; pass++) {
+        if (retired_before != NULL &&
+            __atomic_load_n(&readers[(epoch - 1) & 1], __ATOMIC_SEQ_CST) == 0) {
+            free_retired(retired_before);
+            retired_before = NULL;
+        }
+        if (retired_before != NULL || retired_since == NULL) {
+            break;
+        }
+        retired_before = retired_since;
+        retired_since = NULL;
+        __atomic_store_n(&epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    }
+    __atomic_store_n(&have_retired, retired_before != NULL || retired_since != NULL,
+                     __ATOMIC_RELAXED);
+}
+
+// Caller must hold registry_mutex
+static void retire(void *ptr, void (*release)(Car *car)) {
+    struct retired *r = malloc(sizeof(struct retired));
+    if (r == NULL) {
+        perror("malloc"); // Leaked rather than freed under a reader
+        return;
+    }
+    r->ptr = ptr;
+    r->release = release;
+    r->next = retired_since;
+    retired_since = r;
+    __atomic_store_n(&have_retired, 1, __ATOMIC_RELAXED);
+}
+
+unsigned registry_enter(void) {
+    while (1) {
+        unsigned current = __atomic_load_n(&epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&readers[current & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&epoch, __ATOMIC_SEQ_CST) == current) {
+            return current;
+        }
+        __atomic_sub_fetch(&readers[current & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void registry_exit(unsigned entered) {
+    if (__atomic_sub_fetch(&readers[entered & 1], 1, __ATOMIC_SEQ_CST) == 0 &&
+        __atomic_load_n(&have_retired, __ATOMIC_RELAXED) &&
+        pthread_mutex_trylock(&registry_mutex) == 0) {
+        reclaim();
+        pthread_mutex_unlock(&registry_mutex);
+    }
+}
+
+Car *const *registry_cars(size_t *count) {
+    car_list *current = __atomic_load_n(&list, __ATOMIC_SEQ_CST);
+    if (current == NULL) {
+        *count = 0;
+        return NULL;
+    }
+    *count = __atomic_load_n(&current->count, __ATOMIC_ACQUIRE);
+    return current->cars;
+}
+
+// Put car in an emptied slot, at the end of the list, or at the end of a
+// bigger copy of it. Returns -1 if the list had to grow and could not.
+// Caller must hold registry_mutex
+static int list_insert(Car *car) {
+    if (free_count > 0) {
+        car->registry_slot = free_slots[--free_count];
+        __atomic_store_n(&list->cars[car->registry_slot], car, __ATOMIC_RELEASE);
+        return 0;
+    }
+    if (list == NULL || list->count == list->capacity) {
+        size_t capacity = list != NULL ? list->capacity * 2 : REGISTRY_INITIAL_CAPACITY;
+        car_list *bigger = malloc(sizeof(car_list) + capacity * sizeof(Car *));
+        size_t *slots = realloc(free_slots, capacity * sizeof(size_t));
+        if (slots != NULL) {
+            free_slots = slots;
+        }
+        if (bigger == NULL || slots == NULL) {
+            perror("malloc");
+            free(bigger);
+            return -1;
+        }
+        bigger->count = list != NULL ? list->count : 0;
+        bigger->capacity = capacity;
+        if (list != NULL) {
+            memcpy(bigger->cars, list->cars, list->count * sizeof(Car *));
+            retire(list, NULL);
+        }
+        __atomic_store_n(&list, bigger, __ATOMIC_SEQ_CST);
+    }
+    car->registry_slot = list->count;
+    list->cars[list->count] = car;
+    __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+// Caller must hold registry_mutex
+static void list_delete(Car *car) {
+    __atomic_store_n(&list->cars[car->registry_slot], NULL, __ATOMIC_RELAXED);
+    free_slots[free_count++] = car->registry_slot;
+}
+
+int registry_add(Car *car, Car **replaced) {
+    pthread_mutex_lock(&registry_mutex);
+    *replaced = NULL;
+    if (index_grow() == -1 || list_insert(car) == -1) {
+        pthread_mutex_unlock(&registry_mutex);
+        return -1;
+    }
+    size_t slot = index_slot(car->name, strlen(car->name));
+    *replaced = index_slots[slot];
+    if (*replaced != NULL) {
+        list_delete(*replaced);
+    } else {
+        index_count++;
+    }
+    index_slots[slot] = car;
+    reclaim();
+    pthread_mutex_unlock(&registry_mutex);
+    return 0;
+}
+
+void registry_remove(Car *car, void (*release)(Car *car)) {
+    pthread_mutex_lock(&registry_mutex);
+    size_t slot = index_capacity > 0 ? index_slot(car->name, strlen(car->name)) : 0;
+    if (index_capacity > 0 && index_slots[slot] == car) {
+        list_delete(car);
+        index_delete(slot);
+    }
+    retire(car, release);
+    reclaim();
+    pthread_mutex_unlock(&registry_mutex);
+}
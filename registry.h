@@ -0,0 +1,52 @@
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stddef.h>
+#include "car_shared_mem.h"
+
+// The cars registered with the controller, see add_car() in controller.c.
+//
+// Cars register and leave rarely, calls are dispatched all the time, so the
+// two never wait for each other. Changes are made under a mutex, while
+// dispatch walks the car list without taking any lock. Each car has a slot
+// in the list: a leaving car's slot is emptied and handed to the next car
+// to register, and the list is only copied when it has to grow. A private
+// name index (open addressing, linear probing) finds the car a registering
+// car replaces, so registering and leaving are O(1).
+//
+// A car that has left, or a list replaced by a bigger copy, may still be
+// in use by a reader. It is only freed once every reader that could have
+// seen it has called registry_exit(): readers are counted in one of two
+// epochs, and whatever was retired before the epoch last changed is freed
+// once the old epoch has no readers left.
+
+#define REGISTRY_INITIAL_CAPACITY 16 // Power of two
+
+// Mark the start and end of a stretch in which the caller holds Car
+// pointers it got from the registry. Cheap enough to bracket every call
+// pad request. registry_exit() takes what registry_enter() returned.
+unsigned registry_enter(void);
+void registry_exit(unsigned epoch);
+
+// The registered cars: *count slots, read with registry_car(). Caller must
+// be between registry_enter() and registry_exit().
+Car *const *registry_cars(size_t *count);
+
+// The car in slot i of the list registry_cars() returned, or NULL if the
+// slot is empty.
+static inline Car *registry_car(Car *const *cars, size_t i) {
+    return __atomic_load_n(&cars[i], __ATOMIC_ACQUIRE);
+}
+
+// Register car under its name. A car already registered under the name is
+// dropped from the registry and returned in *replaced, for the caller to
+// log; its transport still owns it and removes it as usual. Sets *replaced
+// to NULL otherwise. Returns -1 if the registry could not grow.
+int registry_add(Car *car, Car **replaced);
+
+// Drop car from the registry if it is still there, and have release(car)
+// called once no reader can be holding it. Its transport must be done with
+// it.
+void registry_remove(Car *car, void (*release)(Car *car));
+
+#endif // REGISTRY_H
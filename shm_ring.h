@@ -0,0 +1,109 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+// Shared-memory channel between a car and the controller, an alternative to
+// sending STATUS/FLOOR over the socket.
+//
+// A car started with --shm creates SHM_CHANNEL_PREFIX{name}, maps a
+// shm_channel into it and appends SHM_OPTION to its CAR message. If the
+// controller can map the same object, and is not running --io uring, it
+// answers with a SHM_OPTION text frame; from then on the car writes wire_status records (see protocol.h)
+// to to_controller and reads wire_floor records from to_car. The socket
+// stays open for registration, call pads and noticing that either side
+// has gone away.
+//
+// Each direction is a single-producer/single-consumer ring of fixed-size
+// slots. Consumers sleep on a process-shared futex and producers only make
+// the wake syscall when the consumer has said it is about to sleep.
+
+#define SHM_OPTION "SHM"
+#define SHM_CHANNEL_PREFIX "/ring"
+#define RING_SLOTS 256     // Power of two
+#define RING_SLOT_SIZE 16  // Length byte, then the record
+
+typedef struct {
+    _Alignas(64) uint32_t head;   // Next slot to read, written by the consumer
+    _Alignas(64) uint32_t tail;   // Next slot to write, written by the producer
+    _Alignas(64) uint32_t seq;    // Futex word, bumped to wake the consumer
+    uint32_t waiting;             // 1 while the consumer may be asleep on seq
+    uint32_t closed;              // Set by the side tearing the channel down
+    _Alignas(64) uint8_t slots[RING_SLOTS][RING_SLOT_SIZE];
+} shm_ring;
+
+typedef struct {
+    shm_ring to_controller;       // STATUS records from the car
+    shm_ring to_car;              // FLOOR records from the controller
+} shm_channel;
+
+static inline void ring_wake(shm_ring *ring) {
+    __atomic_add_fetch(&ring->seq, 1, __ATOMIC_SEQ_CST);
+    syscall(SYS_futex, &ring->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+// Copy a record into the ring. Returns 0, or -1 if the record is too big or
+// the consumer has fallen RING_SLOTS records behind.
+static inline int ring_push(shm_ring *ring, const void *record, size_t len) {
+    uint32_t tail = ring->tail;
+    if (len >= RING_SLOT_SIZE ||
+        tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == RING_SLOTS) {
+        return -1;
+    }
+    uint8_t *slot = ring->slots[tail & (RING_SLOTS - 1)];
+    slot[0] = (uint8_t)len;
+    memcpy(slot + 1, record, len);
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->waiting, __ATOMIC_SEQ_CST)) {
+        ring_wake(ring);
+    }
+    return 0;
+}
+
+// Copy the oldest record into buf (at least RING_SLOT_SIZE bytes), sleeping
+// until there is one. Returns its length, or -1 once the ring is closed,
+// whether or not records are left in it. The slots are written by the other
+// process, so a length that does not fit a slot closes the ring rather than
+// being trusted.
+static inline int ring_pop(shm_ring *ring, void *buf) {
+    uint32_t head = ring->head;
+    if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+        return -1;
+    }
+    while (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == head) {
+        // Announce the sleep, then re-check: a producer either sees waiting
+        // or its new tail is visible here before we block on seq.
+        __atomic_store_n(&ring->waiting, 1, __ATOMIC_SEQ_CST);
+        uint32_t seq = __atomic_load_n(&ring->seq, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->closed, __ATOMIC_SEQ_CST)) {
+            __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+            return -1;
+        }
+        if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+            syscall(SYS_futex, &ring->seq, FUTEX_WAIT, seq, NULL, NULL, 0);
+        }
+        __atomic_store_n(&ring->waiting, 0, __ATOMIC_RELAXED);
+    }
+    uint8_t *slot = ring->slots[head & (RING_SLOTS - 1)];
+    int len = slot[0];
+    if (len >= RING_SLOT_SIZE) {
+        __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+        return -1;
+    }
+    memcpy(buf, slot + 1, len);
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return len;
+}
+
+// Make ring_pop() return -1 from now on and wake a consumer asleep in it
+static inline void ring_close(shm_ring *ring) {
+    __atomic_store_n(&ring->closed, 1, __ATOMIC_SEQ_CST);
+    ring_wake(ring);
+}
+
+#endif // SHM_RING_H
@@ -0,0 +1,331 @@
+#include "shared.h"
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+#include <sys/un.h>
+#include "../shm_ring.h"
+
+// Benchmark comparing the controller's I/O backends (--io threads,
+// --io epoll and --io uring). For each backend the controller is started,
+// --cars cars register and stream --messages STATUS updates each, then
+// --calls call pad round trips are timed. The controller only answers a
+// STATUS with a FLOOR when the car reaches a stop, so each car is given one
+// stop and its last STATUS arrives there; the FLOOR that comes back shows
+// the whole stream has been handled. Controller CPU time per message is taken from its rusage,
+// which is where the saved syscalls show up. With --binary 1 the cars
+// negotiate binary STATUS/FLOOR records instead of text. With --unix the
+// controller also listens on that Unix domain socket and every client
+// connects through it instead of loopback TCP. With --shm 1 the cars
+// register over the socket but exchange binary STATUS/FLOOR records with
+// the controller through shared-memory rings. With --session 1 the calls
+// are pipelined through one call pad session (up to --window in flight)
+// instead of one connection each, and the call column is time per call.
+// With --batch N (N > 1) each request is a CALLS message carrying N calls.
+
+// You can control the benchmark with the following arguments
+// --cars (value)
+// --messages (value)
+// --window (value)
+// --calls (value)
+// --modes (comma separated list of backends)
+// --binary (0 or 1)
+// --unix (socket path)
+// --shm (0 or 1)
+// --session (0 or 1)
+// --batch (calls per request)
+
+#define DELAY 50000 // 50ms
+#define STATUS_OPENING 0 // enum car_status
+#define STATUS_BETWEEN 4
+
+static int cars = 8;
+static int messages = 10000;
+static int window = 16;
+static int calls = 2000;
+static const char *modes = "threads,epoll,uring";
+static int binary = 0;
+static const char *unix_path = NULL;
+static int shm = 0;
+static int session = 0;
+static int batch = 1;
+
+pid_t controller(const char *);
+int connect_to_controller(void);
+void *car_run(void *);
+void send_status(int, shm_channel *, int, int, int);
+void receive_floor(int, shm_channel *);
+void call_session(void);
+void call_request(char *);
+int64_t us_since(const struct timeval *);
+
+void init_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i += 2) {
+    if (strcmp(argv[i], "--cars") == 0) cars = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--messages") == 0) messages = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--window") == 0) window = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--calls") == 0) calls = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--modes") == 0) modes = argv[i + 1];
+    else if (strcmp(argv[i], "--binary") == 0) binary = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--unix") == 0) unix_path = argv[i + 1];
+    else if (strcmp(argv[i], "--shm") == 0) shm = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--session") == 0) session = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--batch") == 0) batch = atoi(argv[i + 1]);
+    else {
+      fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+void run(const char *mode)
+{
+  pid_t p = controller(mode);
+  usleep(DELAY);
+
+  struct timeval start;
+  gettimeofday(&start, NULL);
+  pthread_t tids[cars];
+  int fds[cars];
+  for (int i = 0; i < cars; i++) {
+    fds[i] = i;
+    pthread_create(&tids[i], NULL, car_run, &fds[i]);
+  }
+  for (int i = 0; i < cars; i++) {
+    pthread_join(tids[i], NULL);
+  }
+  int64_t status_us = us_since(&start);
+
+  gettimeofday(&start, NULL);
+  if (session) {
+    call_session();
+  } else {
+    char request[1024];
+    call_request(request);
+    for (int i = 0; i < calls / batch; i++) {
+      int fd = connect_to_controller();
+      send_message(fd, request);
+      char *reply = receive_msg(fd);
+      free(reply);
+      close(fd);
+    }
+  }
+  int64_t call_us = us_since(&start);
+
+  // Cars stay connected until every call is timed so each has cars to
+  // be dispatched to
+  for (int i = 0; i < cars; i++) {
+    close(fds[i]);
+  }
+  kill(p, SIGINT);
+  int wstatus;
+  struct rusage ru;
+  wait4(p, &wstatus, 0, &ru);
+  int64_t cpu_us = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec +
+                   ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+  int64_t total = (int64_t)cars * messages + calls;
+
+  printf("%-8s %12.0f %12.1f %12.2f\n", mode,
+         (double)cars * messages * 1000000.0 / status_us,
+         (double)call_us / calls,
+         (double)cpu_us / total);
+}
+
+int main(int argc, char **argv)
+{
+  init_args(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("%d cars x %d %s STATUS, %d calls over %s\n", cars, messages,
+         shm ? "shm" : binary ? "binary" : "text", calls, unix_path ? "unix" : "tcp");
+  if (batch < 1) batch = 1;
+  printf("%-8s %12s %12s %12s\n", "backend", "status/s",
+         session || batch > 1 ? "us/call" : "call rtt us", "cpu us/msg");
+  char list[256];
+  strncpy(list, modes, sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *mode = strtok(list, ","); mode != NULL; mode = strtok(NULL, ",")) {
+    run(mode);
+    usleep(DELAY);
+  }
+}
+
+void *car_run(void *arg)
+{
+  int *fdp = arg;
+  char buf[64];
+  shm_channel *ch = NULL;
+  if (shm) {
+    sprintf(buf, "%sBench%d", SHM_CHANNEL_PREFIX, *fdp);
+    int shm_fd = shm_open(buf, O_CREAT | O_RDWR | O_TRUNC, 0666);
+    ftruncate(shm_fd, sizeof(shm_channel));
+    ch = mmap(NULL, sizeof(shm_channel), PROT_READ | PROT_WRITE, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+  }
+
+  // Each car serves two floors of its own, so the call below can only go to it
+  int low = 2 * *fdp + 1, high = low + 1;
+  int fd = connect_to_controller();
+  sprintf(buf, "CAR Bench%d %d %d%s%s", *fdp, low, high, binary ? " BINARY" : "", shm ? " SHM" : "");
+  send_message(fd, buf);
+  if (binary) {
+    free(receive_msg(fd)); // Acknowledgement
+  }
+  if (shm) {
+    free(receive_msg(fd));
+  }
+
+  // Without an acknowledgement the call can overtake the registration,
+  // repeat it until the car is known
+  sprintf(buf, "CALL %d %d", low, high);
+  for (int assigned = 0; !assigned; ) {
+    int pad = connect_to_controller();
+    send_message(pad, buf);
+    char *reply = receive_msg(pad);
+    assigned = strncmp(reply, "CAR", 3) == 0;
+    free(reply);
+    close(pad);
+  }
+  receive_floor(fd, ch); // FLOOR low
+
+  for (int sent = 1; sent < messages; sent++) {
+    send_status(fd, ch, STATUS_BETWEEN, low, high);
+  }
+  send_status(fd, ch, STATUS_OPENING, low, low);
+  receive_floor(fd, ch); // FLOOR high
+
+  if (shm) {
+    munmap(ch, sizeof(shm_channel));
+    sprintf(buf, "%sBench%d", SHM_CHANNEL_PREFIX, *fdp);
+    shm_unlink(buf);
+  }
+  *fdp = fd;
+  return NULL;
+}
+
+void send_status(int fd, shm_channel *ch, int status, int current, int destination)
+{
+  if (shm) {
+    // Type, status, current and destination floor
+    uint16_t cur = htons(current), dst = htons(destination);
+    unsigned char record[6] = { 0x81, status };
+    memcpy(record + 2, &cur, 2);
+    memcpy(record + 4, &dst, 2);
+    while (ring_push(&ch->to_controller, record, sizeof(record)) == -1) {
+      sched_yield();
+    }
+  } else if (binary) {
+    // Length, then type, status, current and destination floor
+    uint16_t cur = htons(current), dst = htons(destination);
+    unsigned char frame[10] = { 0, 0, 0, 6, 0x81, status };
+    memcpy(frame + 6, &cur, 2);
+    memcpy(frame + 8, &dst, 2);
+    send_looped(fd, frame, sizeof(frame));
+  } else {
+    char buf[64];
+    sprintf(buf, "STATUS %s %d %d", status == STATUS_OPENING ? "Opening" : "Between", current, destination);
+    send_message(fd, buf);
+  }
+}
+
+void receive_floor(int fd, shm_channel *ch)
+{
+  if (shm) {
+    char record[RING_SLOT_SIZE];
+    ring_pop(&ch->to_car, record);
+  } else {
+    free(receive_msg(fd));
+  }
+}
+
+void call_session(void)
+{
+  int fd = connect_to_controller();
+  send_message(fd, "SESSION");
+  int requests = calls / batch;
+  int sent = 0, received = 0;
+  char request[1024], buf[1040];
+  call_request(request);
+  while (received < requests) {
+    while (sent < requests && sent - received < window) {
+      sprintf(buf, "%d %s", sent, request);
+      send_message(fd, buf);
+      sent++;
+    }
+    free(receive_msg(fd));
+    received++;
+  }
+  close(fd);
+}
+
+// "CALL 1 2", or a CALLS message with --batch calls
+void call_request(char *request)
+{
+  if (batch == 1) {
+    strcpy(request, "CALL 1 2");
+    return;
+  }
+  strcpy(request, "CALLS");
+  for (int i = 0; i < batch; i++) {
+    strcat(request, " 1 2");
+  }
+}
+
+int64_t us_since(const struct timeval *start)
+{
+  struct timeval now;
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000000LL + now.tv_usec - start->tv_usec;
+}
+
+int connect_to_controller(void)
+{
+  if (unix_path != NULL) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un sockaddr;
+    memset(&sockaddr, 0, sizeof(sockaddr));
+    sockaddr.sun_family = AF_UNIX;
+    strncpy(sockaddr.sun_path, unix_path, sizeof(sockaddr.sun_path) - 1);
+    if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+    {
+      perror("connect()");
+      exit(1);
+    }
+    return fd;
+  }
+
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  // send_message() writes the length and the body separately, keep Nagle
+  // from holding the body back until the header is acknowledged
+  int opt_enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+  return fd;
+}
+
+pid_t controller(const char *mode)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    if (unix_path != NULL) {
+      execlp("./controller", "./controller", "--io", mode, "--unix", unix_path, NULL);
+    } else {
+      execlp("./controller", "./controller", "--io", mode, NULL);
+    }
+    exit(1);
+  }
+
+  return pid;
+}
@@ -0,0 +1,309 @@
+#include "shared.h"
+#include <errno.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/timerfd.h>
+#include <sys/wait.h>
+#include <netinet/tcp.h>
+
+// Benchmark of accept-to-reply latency under bursts of call pads, comparing
+// the thread-per-connection controller (--io threads) with the fixed
+// worker pool (--io pool), coroutine sessions (--io coro) and the epoll
+// reactor. --idle call pad sessions are opened first and stay open without
+// sending anything, which is what tens of thousands of connected call pads
+// look like. --cars cars register and
+// then --bursts bursts of calls arrive at --rate calls/sec for --burst-ms
+// each, --gap-ms apart. Calls are sent open loop: each is a new connection
+// opened on schedule whether or not earlier ones have been answered, so a
+// backend that falls behind shows up as a growing tail rather than a lower
+// send rate. The latency of a call is from connect() to its reply. The
+// controller's peak RSS is taken from its rusage, which is where the stack
+// of a thread per connection, or of a coroutine's, shows up.
+
+// You can control the benchmark with the following arguments
+// --cars (value)
+// --idle (value)
+// --rate (calls per second within a burst)
+// --burst-ms (value)
+// --bursts (value)
+// --gap-ms (value)
+// --modes (comma separated list of backends)
+// --threads (value, passed to the controller, 0 for its default)
+
+#define DELAY 50000 // 50ms
+#define FLOORS 20
+#define MAX_EVENTS 64
+
+static int cars = 4;
+static int idle = 0;
+static int rate = 10000;
+static int burst_ms = 100;
+static int bursts = 5;
+static int gap_ms = 200;
+static const char *modes = "threads,epoll,pool,coro";
+static int threads = 0;
+
+// A call in flight
+struct call {
+  int fd;
+  struct timespec start;
+  char request[64];
+  int request_len;     // 0 once sent
+  char reply[64];
+  size_t received;
+};
+
+pid_t controller(const char *);
+int connect_to_controller(int);
+void *car_run(void *);
+int64_t ns_between(const struct timespec *, const struct timespec *);
+
+void init_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i += 2) {
+    if (strcmp(argv[i], "--cars") == 0) cars = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--idle") == 0) idle = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--rate") == 0) rate = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--burst-ms") == 0) burst_ms = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--bursts") == 0) bursts = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--gap-ms") == 0) gap_ms = atoi(argv[i + 1]);
+    else if (strcmp(argv[i], "--modes") == 0) modes = argv[i + 1];
+    else if (strcmp(argv[i], "--threads") == 0) threads = atoi(argv[i + 1]);
+    else {
+      fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+int compare_ns(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Send the request once the connection is up. Returns -1 if it is not yet.
+int send_request(struct call *c)
+{
+  if (send(c->fd, c->request, c->request_len, MSG_NOSIGNAL) != c->request_len) {
+    if (errno == EAGAIN || errno == ENOTCONN) return -1;
+    perror("send()");
+    exit(1);
+  }
+  c->request_len = 0;
+  return 0;
+}
+
+// Open a call pad connection for a CALL between two random floors
+void start_call(int epfd, unsigned *seed)
+{
+  struct call *c = calloc(1, sizeof(struct call));
+  clock_gettime(CLOCK_MONOTONIC, &c->start);
+  c->fd = connect_to_controller(1);
+
+  int source = rand_r(seed) % FLOORS + 1;
+  int destination = rand_r(seed) % (FLOORS - 1) + 1;
+  if (destination >= source) destination++;
+  int len = sprintf(c->request + 4, "CALL %d %d", source, destination);
+  uint32_t nlen = htonl(len);
+  memcpy(c->request, &nlen, 4);
+  c->request_len = len + 4;
+
+  // Loopback connects usually complete at once, otherwise wait until the
+  // connection is writable
+  struct epoll_event ev;
+  ev.events = send_request(c) == -1 ? EPOLLOUT : EPOLLIN;
+  ev.data.ptr = c;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+}
+
+// Returns 1 once the whole reply is in
+int read_reply(struct call *c)
+{
+  ssize_t n = read(c->fd, c->reply + c->received, sizeof(c->reply) - c->received);
+  if (n <= 0) {
+    if (n == -1 && errno == EAGAIN) return 0;
+    fprintf(stderr, "Controller closed a call without a reply\n");
+    exit(1);
+  }
+  c->received += n;
+  if (c->received < 4) return 0;
+  uint32_t nlen;
+  memcpy(&nlen, c->reply, 4);
+  return c->received >= 4 + ntohl(nlen);
+}
+
+void run(const char *mode)
+{
+  pid_t p = controller(mode);
+  usleep(DELAY);
+
+  pthread_t tids[cars];
+  int fds[cars];
+  for (int i = 0; i < cars; i++) {
+    fds[i] = connect_to_controller(0);
+    char buf[64];
+    sprintf(buf, "CAR Latency%d 1 %d", i, FLOORS);
+    send_message(fds[i], buf);
+    send_message(fds[i], "STATUS Closed 1 1");
+    pthread_create(&tids[i], NULL, car_run, &fds[i]);
+  }
+  int *idle_fds = malloc(idle * sizeof(int));
+  for (int i = 0; i < idle; i++) {
+    idle_fds[i] = connect_to_controller(0);
+    send_message(idle_fds[i], "SESSION");
+  }
+  usleep(DELAY);
+
+  int per_burst = (int)((int64_t)rate * burst_ms / 1000);
+  int total = per_burst * bursts;
+  int64_t *latency = malloc(total * sizeof(int64_t));
+  int started = 0, done = 0;
+  unsigned seed = 1;
+
+  int epfd = epoll_create1(0);
+  int tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = NULL;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+  struct timespec first, last;
+  clock_gettime(CLOCK_MONOTONIC, &first);
+  for (int b = 0; b < bursts; b++) {
+    // One call per tick until the burst is out
+    struct itimerspec its = { { 0, 1000000000L / rate }, { 0, 1 } };
+    timerfd_settime(tfd, 0, &its, NULL);
+    int burst_end = started + per_burst;
+    while (started < burst_end || done < started) {
+      struct epoll_event events[MAX_EVENTS];
+      int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+      for (int i = 0; i < n; i++) {
+        struct call *c = events[i].data.ptr;
+        if (c == NULL) {
+          uint64_t ticks = 0;
+          if (read(tfd, &ticks, sizeof(ticks)) == -1) ticks = 0;
+          for (uint64_t t = 0; t < ticks && started < burst_end; t++, started++) {
+            start_call(epfd, &seed);
+          }
+          if (started == burst_end) {
+            struct itimerspec off = { { 0, 0 }, { 0, 0 } };
+            timerfd_settime(tfd, 0, &off, NULL);
+          }
+        } else if (c->request_len > 0) {
+          if (send_request(c) == 0) {
+            ev.events = EPOLLIN;
+            ev.data.ptr = c;
+            epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+          }
+        } else if (read_reply(c)) {
+          struct timespec now;
+          clock_gettime(CLOCK_MONOTONIC, &now);
+          latency[done++] = ns_between(&c->start, &now);
+          close(c->fd);
+          free(c);
+        }
+      }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &last);
+    usleep(gap_ms * 1000);
+  }
+  close(tfd);
+  close(epfd);
+
+  kill(p, SIGINT);
+  int wstatus;
+  struct rusage ru;
+  wait4(p, &wstatus, 0, &ru);
+  for (int i = 0; i < cars; i++) {
+    close(fds[i]);
+    pthread_join(tids[i], NULL);
+  }
+  for (int i = 0; i < idle; i++) {
+    close(idle_fds[i]);
+  }
+  free(idle_fds);
+
+  qsort(latency, total, sizeof(int64_t), compare_ns);
+  double active_s = (ns_between(&first, &last) - (int64_t)(bursts - 1) * gap_ms * 1000000) / 1e9;
+  printf("%-8s %10.0f %10.1f %10.1f %10.1f %10.1f %10ld\n", mode, total / active_s,
+         latency[total / 2] / 1e3, latency[total * 9 / 10] / 1e3,
+         latency[total * 99 / 100] / 1e3, latency[total - 1] / 1e3, ru.ru_maxrss);
+  free(latency);
+}
+
+int main(int argc, char **argv)
+{
+  init_args(argc, argv);
+  signal(SIGPIPE, SIG_IGN);
+  if (rate < 1 || burst_ms < 1 || bursts < 1 || (int64_t)rate * burst_ms < 1000) {
+    fprintf(stderr, "A burst needs at least one call\n");
+    exit(1);
+  }
+
+  printf("%d bursts of %d ms at %d calls/s, %d ms apart, %d cars, %d idle sessions\n", bursts,
+         burst_ms, rate, gap_ms, cars, idle);
+  printf("%-8s %10s %10s %10s %10s %10s %10s\n", "backend", "calls/s", "p50 us", "p90 us",
+         "p99 us", "max us", "maxrss KB");
+  char list[256];
+  strncpy(list, modes, sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *mode = strtok(list, ","); mode != NULL; mode = strtok(NULL, ",")) {
+    run(mode);
+    usleep(DELAY);
+  }
+}
+
+// Read and drop the FLOORs sent to a car until its connection is closed
+void *car_run(void *arg)
+{
+  int fd = *(int *)arg;
+  char buf[256];
+  while (read(fd, buf, sizeof(buf)) > 0) {
+  }
+  return NULL;
+}
+
+int64_t ns_between(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1000000000LL + end->tv_nsec - start->tv_nsec;
+}
+
+int connect_to_controller(int nonblocking)
+{
+  int fd = socket(AF_INET, SOCK_STREAM | (nonblocking ? SOCK_NONBLOCK : 0), 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1 &&
+      errno != EINPROGRESS)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  int opt_enable = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &opt_enable, sizeof(opt_enable));
+  return fd;
+}
+
+pid_t controller(const char *mode)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    int devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+    char count[16];
+    sprintf(count, "%d", threads);
+    if (threads > 0) {
+      execlp("./controller", "./controller", "--io", mode, "--threads", count, NULL);
+    } else {
+      execlp("./controller", "./controller", "--io", mode, NULL);
+    }
+    exit(1);
+  }
+
+  return pid;
+}
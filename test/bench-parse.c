@@ -0,0 +1,118 @@
+#include "../protocol.h"
+#include <time.h>
+
+// Microbenchmark comparing the controller's old sscanf() message parsing
+// with the hand-written parsers in protocol.c. Each side parses the same
+// mix of STATUS, CALL and CAR frames into integer floors and an enum
+// status, which is what the controller needs from them.
+
+// You can control the benchmark with the following arguments
+// --iterations (value)
+
+static long iterations = 2000000;
+
+static const char *frames[] = {
+  "STATUS Between 12 B3",
+  "STATUS Closed 1 1",
+  "STATUS Opening 999 998",
+  "CALL B21 337",
+  "STATUS Open B99 1",
+  "CALL 4 5",
+  "CAR Alpha B2 100",
+  "STATUS Closing 57 57",
+};
+#define NFRAMES (sizeof(frames) / sizeof(frames[0]))
+
+static volatile long sink;
+
+void init_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i += 2) {
+    if (strcmp(argv[i], "--iterations") == 0) iterations = atol(argv[i + 1]);
+    else {
+      fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+// The previous path: copy fields out with sscanf, then convert them
+long parse_sscanf(const char *frame, size_t len)
+{
+  char name[256], status[8], a[4], b[4];
+  if (strncmp(frame, "STATUS", 6) == 0) {
+    if (sscanf(frame, "STATUS %7s %3s %3s", status, a, b) != 3) return -1;
+    return status_from_name(status) + floor_from_name(a) + floor_from_name(b);
+  }
+  if (strncmp(frame, "CALL", 4) == 0) {
+    if (sscanf(frame, "CALL %3s %3s", a, b) != 2) return -1;
+    return floor_from_name(a) + floor_from_name(b);
+  }
+  if (strncmp(frame, "CAR", 3) == 0) {
+    if (sscanf(frame, "CAR %255s %3s %3s", name, a, b) != 3) return -1;
+    return strlen(name) + floor_from_name(a) + floor_from_name(b);
+  }
+  return -1;
+}
+
+long parse_views(const char *frame, size_t len)
+{
+  switch (message_type(frame, len)) {
+  case MSG_STATUS: {
+    status_msg m;
+    if (parse_status(frame, len, &m) == -1) return -1;
+    return m.status + m.current_floor + m.destination_floor;
+  }
+  case MSG_CALL: {
+    call_msg m;
+    if (parse_call(frame, len, &m) == -1) return -1;
+    return m.source_floor + m.destination_floor;
+  }
+  case MSG_CAR: {
+    car_msg m;
+    if (parse_car(frame, len, &m) == -1) return -1;
+    return m.name_len + m.lowest_floor + m.highest_floor;
+  }
+  default:
+    return -1;
+  }
+}
+
+double run(const char *label, long (*parse)(const char *, size_t))
+{
+  size_t lens[NFRAMES];
+  for (size_t i = 0; i < NFRAMES; i++) lens[i] = strlen(frames[i]);
+
+  struct timespec start, end;
+  long total = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < iterations; i++) {
+    size_t f = i % NFRAMES;
+    total += parse(frames[f], lens[f]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  sink = total;
+
+  double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+  printf("%-8s %12.1f %14.0f\n", label, ns / iterations, iterations * 1e9 / ns);
+  return ns;
+}
+
+int main(int argc, char **argv)
+{
+  init_args(argc, argv);
+
+  // Both parsers must agree before their speed means anything
+  for (size_t i = 0; i < NFRAMES; i++) {
+    if (parse_sscanf(frames[i], strlen(frames[i])) != parse_views(frames[i], strlen(frames[i]))) {
+      fprintf(stderr, "Parsers disagree on \"%s\"\n", frames[i]);
+      exit(1);
+    }
+  }
+
+  printf("%ld frames\n", iterations);
+  printf("%-8s %12s %14s\n", "parser", "ns/frame", "frames/s");
+  double old_ns = run("sscanf", parse_sscanf);
+  double new_ns = run("views", parse_views);
+  printf("speedup  %11.1fx\n", old_ns / new_ns);
+}
@@ -0,0 +1,159 @@
+#include "../queue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark comparing the controller's old stop queue (a fixed array
+// that is scanned to insert and shifted on every pop) with the ring in
+// queue.c. Both are kept at each queue depth while the same pseudo-random
+// stops are added and the next stop is popped, which is what a car with a
+// deep plan in a tall building sees.
+
+// You can control the benchmark with the following arguments
+// --operations (value)
+// --depths (comma separated list of queue depths)
+// --floors (value)
+
+static long operations = 1000000;
+static const char *depths = "10,100,300,900";
+static int floors = 999;
+
+static volatile long sink;
+
+void init_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i += 2) {
+    if (strcmp(argv[i], "--operations") == 0) operations = atol(argv[i + 1]);
+    else if (strcmp(argv[i], "--depths") == 0) depths = argv[i + 1];
+    else if (strcmp(argv[i], "--floors") == 0) floors = atoi(argv[i + 1]);
+    else {
+      fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+// The previous queue: sweeps are numbered from the car's current one, so
+// they are renumbered whenever the first sweep is finished
+typedef struct {
+  QueueItem *items;
+  int size;
+} array_queue;
+
+void array_insert(array_queue *q, int floor, Direction dir, int sweep)
+{
+  int i = 0;
+  while (i < q->size && q->items[i].sweep < sweep) i++;
+  while (i < q->size && q->items[i].sweep == sweep &&
+         (dir == UP ? floor > q->items[i].floor : floor < q->items[i].floor)) i++;
+  if (i < q->size && q->items[i].sweep == sweep && q->items[i].floor == floor) return;
+  memmove(&q->items[i + 1], &q->items[i], (q->size - i) * sizeof(QueueItem));
+  q->items[i] = (QueueItem){ floor, dir, sweep };
+  q->size++;
+}
+
+int array_pop(array_queue *q)
+{
+  int floor = q->items[0].floor;
+  memmove(&q->items[0], &q->items[1], (q->size - 1) * sizeof(QueueItem));
+  q->size--;
+  if (q->size > 0) {
+    int done = q->items[0].sweep;
+    for (int i = 0; i < q->size; i++) q->items[i].sweep -= done;
+  }
+  return floor;
+}
+
+// A stop on one of the next three sweeps. Sweep 0 runs in the direction of
+// the next stop and later sweeps alternate. As in the controller, the first
+// stop in an empty queue always goes on sweep 0.
+void random_stop(unsigned *seed, Direction first, int *floor, Direction *dir, int *sweep)
+{
+  *floor = rand_r(seed) % floors + 1;
+  *sweep = rand_r(seed) % 3;
+  *dir = *sweep % 2 == 0 ? first : first == UP ? DOWN : UP;
+}
+
+double run_array(int depth, long *checksum)
+{
+  array_queue q = { malloc((depth + 2) * sizeof(QueueItem)), 0 };
+  unsigned seed = depth;
+  int floor, sweep;
+  Direction dir;
+  while (q.size < depth) {
+    random_stop(&seed, q.size > 0 ? q.items[0].dir : UP, &floor, &dir, &sweep);
+    array_insert(&q, floor, dir, q.size > 0 ? sweep : 0);
+  }
+
+  struct timespec start, end;
+  long total = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < operations; i++) {
+    random_stop(&seed, q.items[0].dir, &floor, &dir, &sweep);
+    array_insert(&q, floor, dir, sweep);
+    if (q.size > depth) total += array_pop(&q);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  free(q.items);
+  *checksum = total;
+  return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+double run_ring(int depth, long *checksum)
+{
+  Queue q;
+  queue_init(&q);
+  unsigned seed = depth;
+  int floor, sweep;
+  Direction dir;
+  while ((int)q.size < depth) {
+    random_stop(&seed, q.size > 0 ? queue_front(&q)->dir : UP, &floor, &dir, &sweep);
+    queue_insert(&q, floor, dir, q.size > 0 ? sweep : 0);
+  }
+
+  struct timespec start, end;
+  long total = 0;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < operations; i++) {
+    random_stop(&seed, queue_front(&q)->dir, &floor, &dir, &sweep);
+    queue_insert(&q, floor, dir, sweep);
+    if ((int)q.size > depth) {
+      total += queue_front(&q)->floor;
+      queue_pop(&q);
+    }
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  queue_free(&q);
+  *checksum = total;
+  return (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+}
+
+int main(int argc, char **argv)
+{
+  init_args(argc, argv);
+
+  printf("%ld operations over %d floors\n", operations, floors);
+  printf("%8s %14s %14s %10s\n", "depth", "array ns/op", "ring ns/op", "speedup");
+  char list[256];
+  strncpy(list, depths, sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *d = strtok(list, ","); d != NULL; d = strtok(NULL, ",")) {
+    int depth = atoi(d);
+    if (depth < 1 || depth > floors) {
+      fprintf(stderr, "Depth %d needs between 1 and %d floors\n", depth, floors);
+      exit(1);
+    }
+    long array_sum, ring_sum;
+    double array_ns = run_array(depth, &array_sum);
+    double ring_ns = run_ring(depth, &ring_sum);
+    // Both queues must visit the same stops before their speed means anything
+    if (array_sum != ring_sum) {
+      fprintf(stderr, "Queues disagree at depth %d\n", depth);
+      exit(1);
+    }
+    sink = ring_sum;
+    printf("%8d %14.1f %14.1f %9.1fx\n", depth, array_ns / operations, ring_ns / operations,
+           array_ns / ring_ns);
+  }
+}
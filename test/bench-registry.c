@@ -0,0 +1,219 @@
+#include "../registry.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Microbenchmark comparing the controller's old car table (a fixed array
+// where a registering car is looked up by scanning every name, and cars are
+// never removed) with the registry in registry.c. At each fleet size a
+// random car leaves and registers again, which is what a controller sees
+// as cars drop in and out of service. Dispatch walks every car on each call,
+// so the time per car of a walk is measured as well, while --readers
+// threads walk the registry alongside the churn.
+
+// You can control the benchmark with the following arguments
+// --operations (value)
+// --sizes (comma separated list of fleet sizes)
+// --readers (value)
+
+static long operations = 100000;
+static const char *sizes = "10,100,1000,10000";
+static int readers = 2;
+
+static volatile long sink;
+static volatile int stop;
+
+void init_args(int argc, char **argv)
+{
+  for (int i = 1; i < argc - 1; i += 2) {
+    if (strcmp(argv[i], "--operations") == 0) operations = atol(argv[i + 1]);
+    else if (strcmp(argv[i], "--sizes") == 0) sizes = argv[i + 1];
+    else if (strcmp(argv[i], "--readers") == 0) readers = atoi(argv[i + 1]);
+    else {
+      fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
+      exit(1);
+    }
+  }
+}
+
+double ns_since(const struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+Car *new_car(int id)
+{
+  Car *car = calloc(1, sizeof(Car));
+  sprintf(car->name, "Car%d", id);
+  car->socket = id;
+  return car;
+}
+
+void free_car(Car *car)
+{
+  free(car);
+}
+
+// The previous table: a leaving car keeps its entry with socket -1, and a
+// registering car scans the names for one to take over
+typedef struct {
+  Car *cars;
+  int count;
+} array_table;
+
+void array_register(array_table *t, const char *name, int socket)
+{
+  for (int i = 0; i < t->count; i++) {
+    if (t->cars[i].socket == -1 && strcmp(t->cars[i].name, name) == 0) {
+      t->cars[i].socket = socket;
+      return;
+    }
+  }
+  strcpy(t->cars[t->count].name, name);
+  t->cars[t->count++].socket = socket;
+}
+
+double run_array(int size)
+{
+  array_table t = { calloc(size, sizeof(Car)), 0 };
+  char name[32];
+  for (int i = 0; i < size; i++) {
+    sprintf(name, "Car%d", i);
+    array_register(&t, name, i);
+  }
+  unsigned seed = size;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < operations; i++) {
+    int id = rand_r(&seed) % size;
+    t.cars[id].socket = -1;
+    sprintf(name, "Car%d", id);
+    array_register(&t, name, id);
+  }
+  double ns = ns_since(&start);
+  free(t.cars);
+  return ns;
+}
+
+// Walk the fleet as dispatch does
+long walk(void)
+{
+  long total = 0;
+  unsigned epoch = registry_enter();
+  size_t count;
+  Car *const *cars = registry_cars(&count);
+  for (size_t i = 0; i < count; i++) {
+    Car *car = registry_car(cars, i);
+    if (car != NULL) {
+      total += car->socket;
+    }
+  }
+  registry_exit(epoch);
+  return total;
+}
+
+void *reader(void *arg)
+{
+  long *walks = arg;
+  while (!stop) {
+    sink = walk();
+    (*walks)++;
+  }
+  return NULL;
+}
+
+double run_registry(int size, Car **fleet, double *walk_ns)
+{
+  for (int i = 0; i < size; i++) {
+    Car *replaced;
+    fleet[i] = new_car(i);
+    registry_add(fleet[i], &replaced);
+  }
+
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  long walks = 0;
+  while (walks < 100 || ns_since(&start) < 1e8) {
+    sink = walk();
+    walks++;
+  }
+  *walk_ns = ns_since(&start) / walks / size;
+
+  stop = 0;
+  pthread_t tids[readers];
+  long reader_walks[readers];
+  for (int r = 0; r < readers; r++) {
+    reader_walks[r] = 0;
+    pthread_create(&tids[r], NULL, reader, &reader_walks[r]);
+  }
+  unsigned seed = size;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  for (long i = 0; i < operations; i++) {
+    int id = rand_r(&seed) % size;
+    Car *replaced;
+    registry_remove(fleet[id], free_car);
+    fleet[id] = new_car(id);
+    registry_add(fleet[id], &replaced);
+  }
+  double ns = ns_since(&start);
+  stop = 1;
+  for (int r = 0; r < readers; r++) {
+    pthread_join(tids[r], NULL);
+  }
+
+  // Every car must be registered exactly once before the timing means
+  // anything
+  size_t count, registered = 0;
+  unsigned epoch = registry_enter();
+  Car *const *cars = registry_cars(&count);
+  for (int i = 0; i < size; i++) {
+    size_t seen = 0;
+    for (size_t j = 0; j < count; j++) {
+      seen += registry_car(cars, j) == fleet[i];
+    }
+    if (seen != 1) {
+      fprintf(stderr, "Registry lost track of %s\n", fleet[i]->name);
+      exit(1);
+    }
+  }
+  for (size_t j = 0; j < count; j++) {
+    registered += registry_car(cars, j) != NULL;
+  }
+  registry_exit(epoch);
+  if (registered != (size_t)size) {
+    fprintf(stderr, "Registry holds %zu cars, expected %d\n", registered, size);
+    exit(1);
+  }
+  for (int i = 0; i < size; i++) {
+    registry_remove(fleet[i], free_car);
+  }
+  return ns;
+}
+
+int main(int argc, char **argv)
+{
+  init_args(argc, argv);
+
+  printf("%ld departures and registrations, %d readers walking the registry\n", operations, readers);
+  printf("%8s %14s %14s %10s %14s\n", "cars", "array ns/op", "registry ns/op", "speedup", "walk ns/car");
+  char list[256];
+  strncpy(list, sizes, sizeof(list) - 1);
+  list[sizeof(list) - 1] = '\0';
+  for (char *s = strtok(list, ","); s != NULL; s = strtok(NULL, ",")) {
+    int size = atoi(s);
+    if (size < 1) {
+      fprintf(stderr, "Invalid fleet size %d\n", size);
+      exit(1);
+    }
+    Car **fleet = malloc(size * sizeof(Car *));
+    double walk_ns;
+    double array_ns = run_array(size);
+    double registry_ns = run_registry(size, fleet, &walk_ns);
+    free(fleet);
+    printf("%8d %14.1f %14.1f %9.1fx %14.2f\n", size, array_ns / operations,
+           registry_ns / operations, array_ns / registry_ns, walk_ns);
+  }
+}
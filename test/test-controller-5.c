@@ -0,0 +1,117 @@
+#include "shared.h"
+
+// Tester for controller (two cars, a car's waiting passenger goes to the
+// other car when the first disconnects or enters emergency mode)
+
+#define DELAY 50000 // 50ms
+#define MILLISECOND 1000 // 1ms
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p;
+  p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 10 10");
+  usleep(DELAY);
+
+  test_call("CALL 2 5", "CAR Alpha");
+  test_recv(alpha, "RECV: FLOOR 2");
+  // Alpha goes away before picking the passenger up, so Beta has to
+  close(alpha);
+  test_recv(beta, "RECV: FLOOR 2");
+  send_message(beta, "STATUS Closing 10 2");
+  send_message(beta, "STATUS Between 10 2");
+  send_message(beta, "STATUS Opening 2 2");
+  test_recv(beta, "RECV: FLOOR 5");
+  send_message(beta, "STATUS Open 2 5");
+  send_message(beta, "STATUS Closing 2 5");
+  send_message(beta, "STATUS Between 2 5");
+  send_message(beta, "STATUS Opening 5 5");
+  send_message(beta, "STATUS Open 5 5");
+  send_message(beta, "STATUS Closing 5 5");
+  send_message(beta, "STATUS Closed 5 5");
+  usleep(DELAY);
+
+  int gamma = connect_to_controller();
+  send_message(gamma, "CAR Gamma 1 10");
+  send_message(gamma, "STATUS Closed 1 1");
+  usleep(DELAY);
+
+  test_call("CALL 2 3", "CAR Gamma");
+  test_recv(gamma, "RECV: FLOOR 2");
+  // Gamma leaves service with the passenger still waiting
+  send_message(gamma, "EMERGENCY");
+  test_recv(beta, "RECV: FLOOR 2");
+  usleep(DELAY);
+  // Gamma is still connected but takes no more calls
+  test_call("CALL 4 6", "CAR Beta");
+
+  cleanup(p);
+  close(beta);
+  close(gamma);
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  msg(t);
+  char *m = receive_msg(fd);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+}
+
+pid_t controller(void)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
@@ -0,0 +1,103 @@
+#include "shared.h"
+
+// Tester for controller (call batches and call pad sessions)
+
+#define DELAY 50000 // 50ms
+#define MILLISECOND 1000 // 1ms
+
+pid_t controller(void);
+int connect_to_controller(void);
+void test_call(const char *, const char *);
+void test_recv(int, const char *);
+void cleanup(pid_t);
+
+int main()
+{
+  pid_t p;
+  p = controller();
+  usleep(DELAY);
+
+  int alpha = connect_to_controller();
+  send_message(alpha, "CAR Alpha 1 10");
+  send_message(alpha, "STATUS Closed 1 1");
+  int beta = connect_to_controller();
+  send_message(beta, "CAR Beta 1 10");
+  send_message(beta, "STATUS Closed 10 10");
+  usleep(DELAY);
+
+  // Answered in request order, each call by the car nearest to it
+  test_call("CALLS 2 3 9 8 20 1", "CARS Alpha Beta UNAVAILABLE");
+  test_recv(alpha, "RECV: FLOOR 2");
+  test_recv(beta, "RECV: FLOOR 9");
+
+  // A session answers each request with its id, and keeps going past a
+  // bad one
+  int session = connect_to_controller();
+  send_message(session, "SESSION");
+  send_message(session, "1 CALL 3 4");
+  send_message(session, "2 CALLS 8 7");
+  test_recv(session, "RECV: 1 CAR Alpha");
+  test_recv(session, "RECV: 2 CARS Beta");
+  send_message(session, "3 HELLO");
+  test_recv(session, "RECV: 3 INVALID");
+  send_message(session, "4 CALL 5 50");
+  test_recv(session, "RECV: 4 UNAVAILABLE");
+  close(session);
+
+  cleanup(p);
+  close(alpha);
+  close(beta);
+
+  printf("\nTests completed.\n");
+}
+
+void test_call(const char *sendmsg, const char *expectedreply)
+{
+  int fd = connect_to_controller();
+  send_message(fd, sendmsg);
+  char *reply = receive_msg(fd);
+  msg(expectedreply);
+  printf("%s\n", reply);
+  free(reply);
+  close(fd);
+}
+
+void test_recv(int fd, const char *t)
+{
+  msg(t);
+  char *m = receive_msg(fd);
+  printf("RECV: %s\n", m);
+  free(m);
+}
+
+int connect_to_controller(void)
+{
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in sockaddr;
+  memset(&sockaddr, 0, sizeof(sockaddr));
+  sockaddr.sin_family = AF_INET;
+  sockaddr.sin_port = htons(3000);
+  sockaddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(fd, (const struct sockaddr *)&sockaddr, sizeof(sockaddr)) == -1)
+  {
+    perror("connect()");
+    exit(1);
+  }
+  return fd;
+}
+
+void cleanup(pid_t p)
+{
+  // Terminate with SIGINT to allow server to clean up
+  kill(p, SIGINT);
+}
+
+pid_t controller(void)
+{
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("./controller", "./controller", NULL);
+  }
+
+  return pid;
+}
@@ -18,6 +18,9 @@
 // --sim-end (value)
 // --histogram-len (number of bars on histogram)
 // --svg (filename - produces an animated svg)
+// --up-peak (percent of passengers starting at the lowest floor)
+// --batch-window (milliseconds, passed on to the controller)
+// --seed (value - repeats the same passengers, to compare controllers)
 
 #define CAR_DELAY       "100" // string, milliseconds
 #define CARS            1
@@ -33,7 +36,9 @@ static double svg_timescale = 10.0;
 // NUM_PASSENGERS will be scheduled to arrive at random
 // times between SIM_START and SIM_END, and will arrive
 // at a random floor with an intended destination of
-// another random floor
+// another random floor. With --up-peak that share of
+// them all start at the lowest floor instead, as when
+// people arrive at work
 
 typedef struct {
   char from[4], to[4], col[4];
@@ -99,6 +104,9 @@ static int sim_end = SIM_END;
 static int histogram_len = HISTOGRAM_LEN;
 static const char *svg = NULL;
 static const char *svg_anim_id = SVG_ANIM_ID;
+static int up_peak = 0;
+static const char *batch_window = NULL;
+static unsigned seed = 0;
 
 static car_tracker *car_trackers;
 static passenger_data *pdata;
@@ -142,6 +150,9 @@ void init_args(int argc, char **argv)
         else if (strcmp(argv[i], "--svg")==0) svg = argv[i+1];
         else if (strcmp(argv[i], "--svg-anim-id")==0) svg_anim_id = argv[i+1];
         else if (strcmp(argv[i], "--svg-timescale")==0) svg_timescale = atof(argv[i+1]);
+        else if (strcmp(argv[i], "--up-peak")==0) up_peak = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "--batch-window")==0) batch_window = argv[i+1];
+        else if (strcmp(argv[i], "--seed")==0) seed = strtoul(argv[i+1], NULL, 10);
         else {
             fprintf(stderr, "Invalid parameter: %s\n", argv[i]);
             exit(1);
@@ -153,7 +164,7 @@ int main(int argc, char **argv)
 {
     init_args(argc, argv);
 
-    srand(time(NULL));
+    srand(seed != 0 ? seed : time(NULL));
     gettimeofday(&start_tv, NULL);
     pid_t controller_pid = controller();
     car_trackers = malloc(sizeof(car_tracker) * cars);
@@ -165,7 +176,12 @@ int main(int argc, char **argv)
     pthread_t passengers[num_passengers];
     pdata = malloc(sizeof(passenger_data) * num_passengers);
     for (int i = 0; i < num_passengers; i++) {
-        itf(pdata[i].from, rand_between(fti(lowest_floor), fti(highest_floor)));
+        // Only drawn with --up-peak, so --seed repeats the passengers of a plain run
+        if (up_peak > 0 && rand_between(1, 100) <= up_peak) {
+            strcpy(pdata[i].from, lowest_floor);
+        } else {
+            itf(pdata[i].from, rand_between(fti(lowest_floor), fti(highest_floor)));
+        }
         for (;;) {
             itf(pdata[i].to, rand_between(fti(lowest_floor), fti(highest_floor)));
             if (strcmp(pdata[i].from, pdata[i].to) != 0) break;
@@ -434,7 +450,11 @@ pid_t controller(void)
 {
   pid_t pid = fork();
   if (pid == 0) {
-    execlp("./controller", "./controller", NULL);
+    if (batch_window != NULL) {
+      execlp("./controller", "./controller", "--batch-window", batch_window, NULL);
+    } else {
+      execlp("./controller", "./controller", NULL);
+    }
   }
 
   return pid;
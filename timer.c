@@ -0,0 +1,126 @@
+#include <string.h>
+#include <time.h>
+#include "timer.h"
+
+#define LEVEL_MASK (TIMER_SLOTS - 1)
+#define MAX_TICKS ((uint64_t)1 << (TIMER_LEVELS * TIMER_LEVEL_BITS))
+
+uint64_t timer_now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void timer_wheel_init(timer_wheel *w, uint64_t now_ms) {
+    memset(w, 0, sizeof(*w));
+    w->now = now_ms / TIMER_TICK_MS;
+}
+
+// Link t into the slot for its tick: level 0 if it is due within
+// TIMER_SLOTS ticks, otherwise the level whose slots are the coarsest that
+// still tell its tick apart from now. A slot above level 0 is only emptied
+// when the level below wraps onto its stretch of ticks, which for a tick
+// up to TIMER_SLOTS of that level's slots away is the stretch it is in.
+static void link_timer(timer_wheel *w, timer *t) {
+    if (t->expires < w->now) {
+        t->expires = w->now;
+    }
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < TIMER_LEVELS - 1 &&
+           delta >= (uint64_t)1 << ((level + 1) * TIMER_LEVEL_BITS)) {
+        level++;
+    }
+    timer **slot = &w->slots[level][(t->expires >> (level * TIMER_LEVEL_BITS)) & LEVEL_MASK];
+    t->next = *slot;
+    if (t->next != NULL) {
+        t->next->pprev = &t->next;
+    }
+    t->pprev = slot;
+    *slot = t;
+}
+
+static void unlink_timer(timer *t) {
+    *t->pprev = t->next;
+    if (t->next != NULL) {
+        t->next->pprev = t->pprev;
+    }
+    t->next = NULL;
+    t->pprev = NULL;
+}
+
+void timer_start(timer_wheel *w, timer *t, uint64_t now_ms, int ms, timer_fn fn) {
+    if (timer_running(t)) {
+        unlink_timer(t);
+    } else {
+        if (w->count == 0 && now_ms / TIMER_TICK_MS > w->now) {
+            w->now = now_ms / TIMER_TICK_MS; // Nothing to fire in between
+        }
+        w->count++;
+    }
+    // Never early: the first tick starting at or after the deadline
+    t->expires = (now_ms + ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+    if (t->expires >= w->now + MAX_TICKS) {
+        t->expires = w->now + MAX_TICKS - 1;
+    }
+    t->fn = fn;
+    link_timer(w, t);
+}
+
+void timer_stop(timer_wheel *w, timer *t) {
+    if (timer_running(t)) {
+        unlink_timer(t);
+        w->count--;
+    }
+}
+
+// Move the timers of a level's slot down to the levels below
+static void cascade(timer_wheel *w, int level) {
+    timer *t = w->slots[level][(w->now >> (level * TIMER_LEVEL_BITS)) & LEVEL_MASK];
+    while (t != NULL) {
+        timer *next = t->next;
+        unlink_timer(t);
+        link_timer(w, t);
+        t = next;
+    }
+}
+
+void timer_advance(timer_wheel *w, uint64_t now_ms) {
+    uint64_t target = now_ms / TIMER_TICK_MS;
+    while (w->now <= target) {
+        if (w->count == 0) {
+            w->now = target + 1;
+            return;
+        }
+        // Level l is cascaded each time every level below it wraps
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            if ((w->now >> ((level - 1) * TIMER_LEVEL_BITS) & LEVEL_MASK) != 0) {
+                break;
+            }
+            cascade(w, level);
+        }
+        timer **slot = &w->slots[0][w->now & LEVEL_MASK];
+        while (*slot != NULL) {
+            timer *t = *slot;
+            unlink_timer(t);
+            w->count--;
+            t->fn(t);
+        }
+        w->now++;
+    }
+}
+
+int timer_timeout(const timer_wheel *w, uint64_t now_ms) {
+    if (w->count == 0) {
+        return -1;
+    }
+    // The next tick with something to fire, or the next cascade
+    uint64_t tick = w->now;
+    for (int i = 0; i < TIMER_SLOTS; i++, tick++) {
+        if (w->slots[0][tick & LEVEL_MASK] != NULL || (tick & LEVEL_MASK) == 0) {
+            break;
+        }
+    }
+    uint64_t at = tick * TIMER_TICK_MS;
+    return at > now_ms ? (int)(at - now_ms) : 0;
+}
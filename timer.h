@@ -0,0 +1,60 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+#define TIMER_TICK_MS 10         // Resolution of every deadline
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4           // 64^4 ticks, later deadlines fire at the end of the range
+
+// A hierarchical timer wheel owned by one event loop thread. Level 0 has a
+// slot per tick for the next TIMER_SLOTS ticks; each level above has a slot
+// per TIMER_SLOTS ticks of the one below it. A timer goes into the coarsest
+// slot that still tells it apart from now and moves down a level each time
+// the level below wraps, so starting, stopping and expiring a timer are
+// constant time whatever the number of timers. The wheel is not locked:
+// only its owner starts, stops and advances timers on it.
+
+struct timer;
+typedef void (*timer_fn)(struct timer *t);
+
+// Embedded in whatever it times. Zeroed memory is a stopped timer.
+typedef struct timer {
+    struct timer *next;
+    struct timer **pprev;   // NULL while stopped
+    uint64_t expires;       // Tick it fires at
+    timer_fn fn;
+} timer;
+
+typedef struct {
+    uint64_t now;           // Ticks up to here have fired
+    unsigned count;         // Timers running
+    timer *slots[TIMER_LEVELS][TIMER_SLOTS];
+} timer_wheel;
+
+// Milliseconds on the monotonic clock, which is what wheels run on
+uint64_t timer_now_ms(void);
+
+void timer_wheel_init(timer_wheel *w, uint64_t now_ms);
+
+// (Re)start t to call fn once ms from now. A running timer is moved.
+void timer_start(timer_wheel *w, timer *t, uint64_t now_ms, int ms, timer_fn fn);
+
+// Stop t if it is running. It does not fire afterwards.
+void timer_stop(timer_wheel *w, timer *t);
+
+static inline int timer_running(const timer *t) {
+    return t->pprev != NULL;
+}
+
+// Fire every timer due by now_ms, oldest tick first. A timer is stopped
+// before fn is called, so fn may start it again or free it.
+void timer_advance(timer_wheel *w, uint64_t now_ms);
+
+// How long the owner may sleep in epoll_wait() before calling
+// timer_advance() again: -1 with no timers running, otherwise at most
+// TIMER_SLOTS ticks.
+int timer_timeout(const timer_wheel *w, uint64_t now_ms);
+
+#endif // TIMER_H
@@ -0,0 +1,407 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <sys/syscall.h>
+#include "reactor.h"
+#include "uring.h"
+
+// Low bits of user_data say which operation completed; the rest is the
+// connection pointer, or the listener for accepts (alignment leaves the
+// bits free).
+enum uring_op {
+    OP_ACCEPT,
+    OP_RECV,
+    OP_SEND,
+    OP_SHUTDOWN
+};
+#define OP_MASK 3ULL
+
+struct uring_conn {
+    struct conn base;         // Frame parsing and queued output, see reactor.h
+    char *sending;            // Buffer owned by the kernel while a send is in flight
+    size_t sending_len;
+    size_t sending_off;
+    size_t sending_cap;
+    int inflight;             // Submitted operations that still reference this conn
+    int closing;
+    int eof;                  // Session hung up, close once its replies are sent
+    int dirty;                // On the dirty list, output waiting to be submitted
+    struct uring_conn *next_dirty;
+};
+
+static struct {
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_tail_local;
+    unsigned pending;         // Prepared SQEs not yet handed to the kernel
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *br;
+    unsigned short br_tail;
+    char *buffers;
+    struct uring_conn *dirty;
+} ring;
+
+static void ring_enter(unsigned wait) {
+    __atomic_store_n(ring.sq_tail, ring.sq_tail_local, __ATOMIC_RELEASE);
+    while (1) {
+        int ret = syscall(__NR_io_uring_enter, ring.fd, ring.pending, wait,
+                          wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            ring.pending -= ret;
+            return;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EBUSY || errno == EAGAIN) {
+            return; // Completions have to be reaped first
+        }
+        perror("io_uring_enter()");
+        exit(1);
+    }
+}
+
+// Make room for n SQEs so that linked operations are submitted together.
+static void reserve_sqes(unsigned n) {
+    unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+    if (ring.sq_tail_local - head + n > ring.sq_entries) {
+        ring_enter(0);
+    }
+}
+
+static struct io_uring_sqe *get_sqe(void) {
+    reserve_sqes(1);
+    unsigned idx = ring.sq_tail_local & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[idx] = idx;
+    ring.sq_tail_local++;
+    ring.pending++;
+    return sqe;
+}
+
+static void provide_buffer(unsigned short bid) {
+    struct io_uring_buf *buf = &ring.br->bufs[ring.br_tail & (URING_BUFFERS - 1)];
+    buf->addr = (uintptr_t)(ring.buffers + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    ring.br_tail++;
+    __atomic_store_n(&ring.br->tail, ring.br_tail, __ATOMIC_RELEASE);
+}
+
+static void ring_init(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd == -1) {
+        perror("io_uring_setup()");
+        exit(1);
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+    }
+    char *sq_ptr = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring.fd, IORING_OFF_SQ_RING);
+    if (sq_ptr == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+    char *cq_ptr = sq_ptr;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        cq_ptr = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring.fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+    }
+    ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        perror("mmap");
+        exit(1);
+    }
+
+    ring.sq_head = (unsigned *)(sq_ptr + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq_ptr + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq_ptr + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq_ptr + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_tail_local = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(cq_ptr + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cq_ptr + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cq_ptr + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cq_ptr + p.cq_off.cqes);
+
+    // Provided buffer ring shared by every multishot recv
+    ring.br = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    ring.buffers = malloc((size_t)URING_BUFFERS * URING_BUFFER_SIZE);
+    if (ring.br == MAP_FAILED || ring.buffers == NULL) {
+        perror("buffer ring");
+        exit(1);
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t)ring.br;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+        perror("io_uring_register()");
+        exit(1);
+    }
+    for (unsigned short bid = 0; bid < URING_BUFFERS; bid++) {
+        provide_buffer(bid);
+    }
+}
+
+static void arm_accept(struct listener *l) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = l->fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = (uintptr_t)l | OP_ACCEPT;
+}
+
+static void arm_recv(struct uring_conn *uc) {
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = uc->base.fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uintptr_t)uc | OP_RECV;
+    uc->inflight++;
+}
+
+static void submit_send(struct uring_conn *uc) {
+    reserve_sqes(uc->base.state == CONN_CLOSING ? 2 : 1);
+    struct io_uring_sqe *sqe = get_sqe();
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = uc->base.fd;
+    sqe->addr = (uintptr_t)(uc->sending + uc->sending_off);
+    sqe->len = uc->sending_len - uc->sending_off;
+    sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+    sqe->user_data = (uintptr_t)uc | OP_SEND;
+    uc->inflight++;
+
+    if (uc->base.state == CONN_CLOSING) {
+        // Call pad reply: the shutdown only runs once the send has fully
+        // completed, which in turn ends the multishot recv.
+        sqe->flags |= IOSQE_IO_LINK;
+        sqe = get_sqe();
+        sqe->opcode = IORING_OP_SHUTDOWN;
+        sqe->fd = uc->base.fd;
+        sqe->len = SHUT_RDWR;
+        sqe->user_data = (uintptr_t)uc | OP_SHUTDOWN;
+        uc->inflight++;
+    }
+}
+
+// Hand everything queued by conn_send() to the kernel in one send.
+static void start_send(struct uring_conn *uc) {
+    char *out = uc->base.out;
+    size_t out_cap = uc->base.out_cap;
+    uc->base.out = uc->sending;
+    uc->base.out_cap = uc->sending_cap;
+    uc->sending = out;
+    uc->sending_cap = out_cap;
+    uc->sending_len = uc->base.out_len;
+    uc->sending_off = 0;
+    uc->base.out_len = 0;
+    submit_send(uc);
+}
+
+static void maybe_finalize(struct uring_conn *uc) {
+    if (!uc->closing || uc->inflight > 0 || uc->dirty) {
+        return;
+    }
+    close(uc->base.fd);
+    pthread_mutex_destroy(&uc->base.out_lock);
+    free(uc->base.out);
+    free(uc->sending);
+    free(uc);
+}
+
+static void begin_close(struct uring_conn *uc) {
+    if (uc->closing) {
+        return;
+    }
+    uc->closing = 1;
+    if (uc->base.car != NULL) {
+        car_disconnected(uc->base.car);
+    }
+    // Completes the multishot recv and any pending send; the connection is
+    // freed by handle_cqe() once the last of them has been reaped.
+    shutdown(uc->base.fd, SHUT_RDWR);
+}
+
+// conn->flush hook: only note that the connection has output. Sends are
+// submitted together just before the next io_uring_enter().
+static int uring_conn_flush(struct conn *c) {
+    struct uring_conn *uc = (struct uring_conn *)c;
+    if (!uc->dirty) {
+        uc->dirty = 1;
+        uc->next_dirty = ring.dirty;
+        ring.dirty = uc;
+    }
+    return 0;
+}
+
+static void flush_dirty(void) {
+    while (ring.dirty != NULL) {
+        struct uring_conn *uc = ring.dirty;
+        ring.dirty = uc->next_dirty;
+        uc->dirty = 0;
+        if (uc->closing) {
+            maybe_finalize(uc);
+        } else if (uc->sending_len == 0 && uc->base.out_len > 0) {
+            start_send(uc);
+        }
+    }
+}
+
+static void conn_accepted(int fd, int tcp) {
+    struct uring_conn *uc = calloc(1, sizeof(struct uring_conn));
+    if (uc == NULL) {
+        perror("calloc");
+        close(fd);
+        return;
+    }
+    uc->base.fd = fd;
+    uc->base.epfd = -1;
+    uc->base.state = CONN_HELLO;
+    msg_buf_init(&uc->base.in);
+    uc->base.flush = uring_conn_flush;
+    pthread_mutex_init(&uc->base.out_lock, NULL);
+
+    conn_set_nodelay(fd, tcp);
+    arm_recv(uc);
+}
+
+// Copy received bytes into the connection and handle complete frames.
+static int conn_feed(struct uring_conn *uc, const char *data, size_t len) {
+    struct conn *c = &uc->base;
+    while (len > 0) {
+        if (c->state == CONN_CLOSING) {
+            return 0; // Call pads get one request per connection
+        }
+        size_t n = msg_buf_put(&c->in, data, len);
+        if (n == 0) {
+            return -1;
+        }
+        data += n;
+        len -= n;
+        if (conn_parse(c) == -1) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void handle_cqe(struct io_uring_cqe *cqe) {
+    enum uring_op op = cqe->user_data & OP_MASK;
+    void *ptr = (void *)(uintptr_t)(cqe->user_data & ~OP_MASK);
+    struct uring_conn *uc = ptr;
+
+    switch (op) {
+    case OP_ACCEPT: {
+        struct listener *l = ptr;
+        if (cqe->res >= 0) {
+            conn_accepted(cqe->res, l->tcp);
+        } else if (cqe->res != -EINTR && cqe->res != -ECONNABORTED) {
+            fprintf(stderr, "accept(): %s\n", strerror(-cqe->res));
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            arm_accept(l);
+        }
+        return;
+    }
+    case OP_RECV:
+        if (cqe->flags & IORING_CQE_F_BUFFER) {
+            unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            if (cqe->res > 0 && !uc->closing &&
+                conn_feed(uc, ring.buffers + (size_t)bid * URING_BUFFER_SIZE, cqe->res) == -1) {
+                begin_close(uc);
+            }
+            provide_buffer(bid);
+        }
+        if (!(cqe->flags & IORING_CQE_F_MORE)) {
+            uc->inflight--;
+            if (!uc->closing && (cqe->res > 0 || cqe->res == -ENOBUFS)) {
+                arm_recv(uc);
+            } else if (cqe->res == 0 && uc->base.state == CONN_SESSION &&
+                       (uc->sending_len > 0 || uc->dirty)) {
+                uc->eof = 1;
+            } else {
+                begin_close(uc);
+            }
+        }
+        break;
+    case OP_SEND:
+        uc->inflight--;
+        if (cqe->res < 0) {
+            begin_close(uc);
+            break;
+        }
+        uc->sending_off += cqe->res;
+        if (uc->closing) {
+            break;
+        }
+        if (uc->sending_off < uc->sending_len) {
+            submit_send(uc);
+        } else {
+            uc->sending_len = 0;
+            if (uc->base.out_len > 0) {
+                start_send(uc);
+            } else if (uc->eof && !uc->dirty) {
+                begin_close(uc);
+            }
+        }
+        break;
+    case OP_SHUTDOWN:
+        uc->inflight--;
+        break;
+    }
+
+    maybe_finalize(uc);
+}
+
+void uring_run(struct listener *listeners, int count) {
+    ring_init();
+    for (int i = 0; i < count; i++) {
+        arm_accept(&listeners[i]);
+    }
+
+    while (1) {
+        flush_dirty();
+        ring_enter(1);
+
+        unsigned head = *ring.cq_head;
+        unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            handle_cqe(&ring.cqes[head & *ring.cq_mask]);
+            head++;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+}
@@ -0,0 +1,16 @@
+#ifndef URING_H
+#define URING_H
+
+#define URING_ENTRIES 256     // Submission queue depth
+#define URING_BUFFERS 256     // Provided receive buffers (power of two)
+#define URING_BUFFER_SIZE 4096
+#define URING_BUFFER_GROUP 0
+
+struct listener;
+
+// Serve the listeners from a single io_uring instance: one multishot accept
+// per listener, one multishot provided-buffer recv per connection, and sends
+// submitted in batches once per loop iteration. Does not return.
+void uring_run(struct listener *listeners, int count);
+
+#endif // URING_H